@@ -252,6 +252,10 @@ int main(int argc, char *argv[]) {
 
     char *dir_to_process = argv[optind];
 
+    // file_process() печатает несколько строк на файл: полный буфер вместо
+    // построчного сброса на терминал, вывод уходит крупными блоками
+    setvbuf(stdout, NULL, _IOFBF, 1 << 20);
+
     if (ftw(dir_to_process, file_process, 20) == -1) {
         perror("ftw");
         free_loaded_plugins();
@@ -1,12 +1,30 @@
-#define _XOPEN_SOURCE 500
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
 #include <ftw.h>
+#include <dirent.h>
+#include <time.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <setjmp.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
 #include <sys/param.h>      // для MIN()
 #include <getopt.h>
 #include <dlfcn.h>
+#include <linux/ioprio.h>
 #include "plugin_api.h"
 
 // Объявление функций
@@ -14,32 +32,551 @@ int open_func(const char *fpath, const struct stat *sb, int typeflag);
 void open_dyn_libs(const char *dir);
 void optparse(int argc, char *argv[]);
 void walk_dir(const char *dir);
+void free_plugins(void);
+int load_used_plugins(void);
+void manifest_load(void);
+void manifest_save(void);
+void manifest_free(void);
+struct option *build_long_options(void);
+int parse_shard(const char *arg);
+int parse_rate(const char *arg, int suffixes, double *out);
+int parse_range(const char *arg);
+void region_check(void);
+int in_shard(const char *fpath);
+const char *rel_path(const char *fpath);
+int walk_order_cmp(const char *a, const char *b);
+void walk_tree(char *path, size_t path_len, const struct stat *dsb);
+int snap_load(const char *fname);
+int snap_save(void);
+void snap_free(void);
+int sink_start(const char *format);
+void sink_flush_all(void);
+void sink_stop(void);
+int ckpt_open(const char *fname);
+int ckpt_load(const char *fname);
+void ckpt_flush(void);
+void ckpt_close(void);
+int pool_start(int cnt);
+void pool_submit(const char *path, unsigned long seq);
+void pool_drain(void);
+void pool_stop(void);
+int expr_compile(const char *src);
+int expr_compile_legacy(void);
+int expr_add_root(int root, const char *id);
+int queries_load(const char *fname);
+int expr_check(void);
+void expr_free(void);
+int iso_start(int cnt);
+void iso_submit(const char *path, unsigned long seq);
+void iso_wait(void);
+void iso_drain(void);
+void iso_stop(void);
+int throttle_start(void);
+void io_bus(int sig);
+void throttle_stop(void);
 
 // Указатели на функции
 typedef int (*ppf_func_t)(const char*, struct option*, size_t);
 typedef int (*pgi_func_t)(struct plugin_info*);
+typedef int (*png_func_t)(int);
+typedef int (*pbf_func_t)(const unsigned char*, size_t, struct option*, size_t);
+typedef void *(*pso_func_t)(struct option*, size_t);
+typedef int (*psf_func_t)(void*, const unsigned char*, size_t);
+typedef int (*psc_func_t)(void*);
+typedef void *(*psr_func_t)(struct option*, size_t, unsigned long long, size_t);
 
 // Структура для хранения информации о динамических библиотеках
 typedef struct {
-    void* lib;                  // Дескриптор загруженной библиотеки
+    char *path;                 // Путь к файлу библиотеки
+    struct stat sb;             // Атрибуты файла на момент поиска (ключ манифеста)
+    void* lib;                  // Дескриптор загруженной библиотеки (NULL - ещё не загружена)
     struct plugin_info pi;      // Информация о плагине
     ppf_func_t ppf;             // Указатель на функцию обработки файлов плагина
     struct option* in_opts;     // Опции, предоставленные плагину
     size_t in_opts_len;         // Количество предоставленных опций
+    int used;                   // Плагин участвует в выражении и должен быть загружен
+    pbf_func_t pbf;             // Обработка буфера (PLUGIN_CAP_BUFFER), иначе NULL
+    pso_func_t pso;             // Потоковая обработка (PLUGIN_CAP_STREAM), иначе NULL
+    psf_func_t psf;
+    psc_func_t psc;
+    psr_func_t psr;             // Поток по участку файла (PLUGIN_CAP_REGION), иначе NULL
+    pthread_mutex_t lock;       // Сериализация вызовов плагина без PLUGIN_CAP_REENTRANT
 } dynamic_lib; 
 
+// Описание плагина в манифесте - кеше информации о плагинах, по которому
+// разбор опций и -h работают без dlopen(). Запись действительна, пока у файла
+// те же inode, размер и mtime.
+typedef struct {
+    const char *path;
+    long long mtime_sec, mtime_nsec, size;
+    unsigned long long ino;
+    struct plugin_info pi;      // Строки указывают в manifest_text
+} manifest_entry;
+
+manifest_entry *manifest = NULL;    // Записи манифеста текущего каталога плагинов
+size_t manifest_len = 0;
+char *manifest_text = NULL;     // Содержимое файла манифеста
+char *manifest_file = NULL;     // Имя файла манифеста (NULL - кеш не используется)
+int manifest_dirty = 0;         // Найдены плагины, которых нет в манифесте
+size_t manifest_hits = 0;       // Плагинов, описанных манифестом
+
+const manifest_entry *manifest_find(const char *fpath, const struct stat *sb);
+
 // Глобальные переменные для динамических библиотек
 dynamic_lib *plugins = NULL;    // Массив загруженных плагинов
 int plug_cnt = 0;               // Количество загруженных плагинов
 int or = 0, not = 0;            // Флаги логических операций
+int got_logic = 0;              // Указана ли хотя бы одна из опций -A/-O/-N
 int found_opts = 0, got_opts = 0;// Количество найденных и полученных опций
 
+// Коды длинных опций хоста (вне диапазона символов, чтобы не пересекаться с короткими опциями)
+enum {
+    OPT_SHARD = 256,
+    OPT_CHECKPOINT,
+    OPT_RESUME,
+    OPT_ISOLATE,
+    OPT_THREADS,
+    OPT_EXPR,
+    OPT_QUERIES,
+    OPT_FORMAT,
+    OPT_ORDERED,
+    OPT_UNORDERED,
+    OPT_IO,
+    OPT_MAX_READ_RATE,
+    OPT_MAX_IOPS,
+    OPT_MAX_CPU,
+    OPT_NICE,
+    OPT_IOPRIO,
+    OPT_RANGE,
+    OPT_ALIGN,
+    OPT_SNAPSHOT,
+    OPT_FILE_TIMEOUT,
+};
+
+// Длинные опции самого хоста, добавляются к опциям плагинов
+static struct option host_opts[] = {
+    {"shard", required_argument, 0, OPT_SHARD},
+    {"checkpoint", required_argument, 0, OPT_CHECKPOINT},
+    {"resume", required_argument, 0, OPT_RESUME},
+    {"isolate", required_argument, 0, OPT_ISOLATE},
+    {"threads", required_argument, 0, OPT_THREADS},
+    {"expr", required_argument, 0, OPT_EXPR},
+    {"queries", required_argument, 0, OPT_QUERIES},
+    {"format", required_argument, 0, OPT_FORMAT},
+    {"ordered", no_argument, 0, OPT_ORDERED},
+    {"unordered", no_argument, 0, OPT_UNORDERED},
+    {"io", required_argument, 0, OPT_IO},
+    {"max-read-rate", required_argument, 0, OPT_MAX_READ_RATE},
+    {"max-iops", required_argument, 0, OPT_MAX_IOPS},
+    {"max-cpu", required_argument, 0, OPT_MAX_CPU},
+    {"nice", required_argument, 0, OPT_NICE},
+    {"ioprio", required_argument, 0, OPT_IOPRIO},
+    {"range", required_argument, 0, OPT_RANGE},
+    {"align", required_argument, 0, OPT_ALIGN},
+    {"snapshot", required_argument, 0, OPT_SNAPSHOT},
+    {"file-timeout", required_argument, 0, OPT_FILE_TIMEOUT},
+};
+static const size_t host_opts_len = sizeof(host_opts) / sizeof(host_opts[0]);
+
+// Параметры шардирования: файл обрабатывается, только если hash(отн. путь) % shard_cnt == shard_idx
+unsigned long shard_idx = 0, shard_cnt = 1;
+size_t root_len = 0;            // Длина пути корня обхода (для получения относительного пути)
+
+// Контрольная точка. Обход идёт в детерминированном порядке (имена в каталоге
+// отсортированы), поэтому всё пройденное описывается одним путём - фронтом обхода:
+// файлы и поддеревья до него в порядке обхода завершены. Файл дописывается
+// пакетами строк "M <путь>" (найденные файлы) и "F <путь>" (фронт).
+// С потоками и рабочими процессами фронт сдвигается окном упорядочивания:
+// им становится последний файл, все предшественники которого завершены,
+// поэтому запись точки не ждёт файлов, которые ещё обрабатываются.
+#define CKPT_EVERY_FILES 4096           // Запись контрольной точки каждые N файлов
+#define CKPT_EVERY_SEC 5                // ... или каждые N секунд
+#define CKPT_MAX_PENDING (256 * 1024)   // ... или при накоплении стольких байт результатов
+
+FILE *ckpt_file = NULL;         // Файл контрольной точки (открыт на дозапись)
+char *ckpt_name = NULL;         // Имя файла контрольной точки
+char *ckpt_buf = NULL;          // Накопленные с прошлой записи строки "M ..."
+size_t ckpt_buf_len = 0, ckpt_buf_cap = 0;
+char *ckpt_frontier = NULL;     // Последний завершённый файл (относительный путь)
+unsigned long ckpt_pending = 0; // Файлов завершено с прошлой записи
+time_t ckpt_last = 0;           // Время прошлой записи
+char *resume_frontier = NULL;   // Фронт из --resume, всё до него пропускается
+
+// Снимок дерева (--snapshot): для каждого каталога - его dev/ino, mtime/ctime
+// и отсортированные записи с типом, размером и mtime. Каталог, у которого
+// mtime и ctime не изменились, воспроизводится из снимка без readdir() и stat()
+// файлов; stat() нужен только подкаталогам, чтобы проверить их самих.
+// Размер и mtime записи - на момент последнего чтения каталога: при любом
+// изменении mtime/ctime каталога все его записи читаются и проверяются заново.
+// Файл снимка отображается в память как есть: заголовок, массив каталогов,
+// отсортированный по относительному пути, массив записей и строки имён.
+#define SNAP_MAGIC "LAB1SNP\x01"
+enum { SNAP_OTHER, SNAP_REG, SNAP_DIR };
+#define SNAP_LINK 0x100         // Запись - символическая ссылка: цель проверяется заново
+
+struct snap_header {
+    char magic[8];
+    int64_t scan_time;          // Время начала обхода, по которому записан снимок
+    uint64_t dirs_len, ents_len, names_len;
+};
+
+struct snap_dir {
+    uint64_t dev, ino;
+    int64_t mtime_sec, mtime_nsec, ctime_sec, ctime_nsec;
+    uint64_t path;              // Относительный путь (смещение в строках)
+    uint64_t first, count;      // Записи каталога
+};
+
+struct snap_ent {
+    uint64_t name;              // Имя (смещение в строках)
+    uint64_t size;
+    int64_t mtime_sec, mtime_nsec;
+    uint32_t type;              // SNAP_* | SNAP_LINK
+    uint32_t reserved;
+};
+
+char *snap_name = NULL;         // Файл снимка
+void *snap_map = NULL;          // Отображение прошлого снимка (NULL - его нет)
+size_t snap_map_len = 0;
+const struct snap_header *snap_old = NULL;
+const struct snap_dir *snap_old_dirs = NULL;
+const struct snap_ent *snap_old_ents = NULL;
+const char *snap_old_names = NULL;
+struct snap_dir *snap_dirs = NULL;      // Новый снимок
+struct snap_ent *snap_ents = NULL;
+char *snap_names = NULL;
+size_t snap_dirs_len = 0, snap_dirs_cap = 0;
+size_t snap_ents_len = 0, snap_ents_cap = 0;
+size_t snap_names_len = 0, snap_names_cap = 0;
+time_t snap_scan_time = 0;
+unsigned long snap_replayed = 0, snap_read = 0;
+
+// Изолированный режим: плагины выполняются в заранее запущенных рабочих процессах.
+// У каждого процесса своё кольцо слотов в общей памяти; хост кладёт путь в слот
+// и увеличивает счётчик eventfd запросов, процесс пишет результаты плагинов в тот
+// же слот и увеличивает счётчик eventfd ответов. Слоты обрабатываются строго по
+// порядку, поэтому номер слота определяется числом отправленных/завершённых файлов.
+// Падение процесса обнаруживается по закрытию pipe, который держит только он,
+// зависание - по сроку обработки файла (--file-timeout), после чего процесс убивается.
+// Если плагины принимают данные, файлы до ISO_DATA_MAX хост читает сам и кладёт
+// содержимое в слот, и рабочий процесс не открывает файл заново.
+#define ISO_RING 16
+#define ISO_DATA_MAX (256 * 1024)
+#define ISO_TIMEOUT_DEFAULT 600
+
+// Слот кольца: путь к файлу, его содержимое и результаты всех запросов
+struct iso_slot {
+    char path[PATH_MAX];
+    unsigned long seq;          // Номер файла в порядке обхода
+    ssize_t data_len;           // Длина содержимого в слоте (-1 - файл читает рабочий процесс)
+    int res[];                  // Затем, с выравниванием, ISO_DATA_MAX байт содержимого
+};
+
+typedef struct {
+    pid_t pid;                  // Рабочий процесс
+    int req_fd, resp_fd;        // eventfd запросов и ответов
+    int death_fd;               // Конец pipe для чтения, EOF - процесс завершился
+    unsigned char *ring;        // ISO_RING слотов в общей памяти
+    unsigned long submitted;    // Отправлено файлов
+    unsigned long completed;    // Завершено файлов
+    struct timespec head_start; // Начало обработки первого незавершённого файла
+    int timed_out;              // Процесс убит по сроку обработки
+} iso_worker;
+
+iso_worker *iso = NULL;         // Пул рабочих процессов
+int iso_cnt = 0;                // Размер пула (0 - плагины вызываются в хосте)
+size_t iso_slot_size = 0;       // Размер слота с учётом числа плагинов
+size_t iso_data_off = 0;        // Смещение содержимого файла в слоте (0 - слоты без содержимого)
+long iso_timeout = ISO_TIMEOUT_DEFAULT; // --file-timeout, секунды (0 - без ограничения)
+
+// Файлы до этого размера читаются в память целиком и передаются плагинам с
+// PLUGIN_CAP_BUFFER, файлы больше - блоками по STREAM_CHUNK плагинам с PLUGIN_CAP_STREAM.
+// Плагины, которые не могут принять данные, получают путь к файлу, как в версии 1.
+#define BUF_MAX (64 * 1024 * 1024)
+#define STREAM_CHUNK (1024 * 1024)
+
+// Способ чтения файла (--io). В режиме auto файлы до BUF_MAX читаются pread()
+// в буфер, большие читаются блоками, и из кэша сбрасываются страницы, которые
+// подгрузил сам обход (POSIX_FADV_DONTNEED), чтобы полный обход не вытеснял
+// рабочие данные других процессов. mmap() используется только по --io mmap:
+// если файл укоротят во время проверки, обращение к отображению даст SIGBUS,
+// и файл будет считаться необработанным (io_bus()).
+// В режиме direct файлы читаются мимо кэша (O_DIRECT), если ФС это позволяет.
+enum { IO_AUTO, IO_PREAD, IO_MMAP, IO_DIRECT };
+#define IO_ALIGN 4096           // Выравнивание буферов для O_DIRECT
+
+#define IO_LOOKAHEAD 32         // Блоков, для которых состояние кэша известно заранее;
+                                // должно покрывать упреждающее чтение ядра
+
+int io_mode = IO_AUTO;
+_Thread_local sigjmp_buf *io_bus_jmp = NULL; // Точка возврата при SIGBUS (NULL - вне обращения к отображению)
+
+// Какие страницы участка файла уже в кэше (младший бит байта на страницу,
+// начиная со страницы, содержащей off). Участок не длиннее STREAM_CHUNK.
+typedef struct {
+    off_t off, len;             // len == 0 - состояние неизвестно
+    unsigned char vec[STREAM_CHUNK / IO_ALIGN + 2];
+} io_res;
+
+// Ограничение нагрузки (--max-read-rate, --max-iops, --max-cpu): корзины
+// маркеров, общие для всех потоков и рабочих процессов. Чтение и обработка
+// расходуют маркеры; при нехватке поток спит, пока долг не восполнится.
+// Запас корзины - THROTTLE_BURST секунд работы на полной скорости.
+#define THROTTLE_BURST 0.1
+
+typedef struct {
+    double rate;                // Маркеров в секунду (0 - без ограничения)
+    double tokens;              // Остаток; отрицательный - долг
+    struct timespec last;       // Время последнего пополнения
+    pthread_mutex_t mx;         // Разделяемый между процессами
+} bucket;
+
+typedef struct {
+    bucket read;                // Байты чтения
+    bucket iops;                // Операции чтения
+    bucket cpu;                 // Секунды процессорного времени плагинов
+} throttle_state;
+
+throttle_state *throttle = NULL;    // В общей памяти (NULL - ограничений нет)
+double max_read_rate = 0;       // Значение --max-read-rate, байт/с
+double max_iops = 0;            // Значение --max-iops
+double max_cpu = 0;             // Значение --max-cpu, % одного процессора
+int nice_set = 0, nice_arg = 0; // --nice
+char *ioprio_arg = NULL;        // --ioprio
+
+// Буфер чтения файла, свой у каждого потока и рабочего процесса.
+// Выровнен по IO_ALIGN, чтобы в него можно было читать с O_DIRECT.
+typedef struct {
+    unsigned char *data;
+    size_t cap;
+} io_buf;
+
+// Выражение над плагинами компилируется в граф решений (DAG): листья - вызовы
+// плагина с опциями, внутренние узлы - AND/OR/NOT. Режим -A/-O/-N собирается
+// в такой же граф.
+enum { EXPR_LEAF, EXPR_AND, EXPR_OR, EXPR_NOT };
+
+// Стоимость байта для плагина, который её не сообщил (версия 1 сама читает файл)
+#define EXPR_UNKNOWN_COST 50.0
+
+typedef struct {
+    int op;                     // EXPR_*
+    int plugin;                 // Лист: номер плагина
+    struct option *opts;        // Лист: опции вызова
+    size_t opts_len;
+    int *kids;                  // Потомки, упорядоченные по стоимости
+    size_t kids_len;
+    double cost;                // Оценка стоимости вычисления узла
+} expr_node;
+
+expr_node *expr_nodes = NULL;   // Узлы графа
+size_t expr_len = 0;
+int *expr_roots = NULL;         // Корни графа, по одному на запрос
+char **expr_ids = NULL;         // Идентификаторы запросов (NULL - единственный запрос без метки)
+size_t expr_root_cnt = 0;
+char *expr_arg = NULL;          // Текст выражения --expr
+char *queries_arg = NULL;       // Файл запросов --queries
+
+// Участки файла для проверки (--range): начало (отрицательное - от конца файла)
+// и длина (0 - до конца файла). Без --range проверяется весь файл.
+#define RANGE_MAX 16
+
+typedef struct {
+    long long start;
+    unsigned long long len;
+} file_range;
+
+file_range ranges[RANGE_MAX];
+size_t ranges_len = 0;
+size_t scan_align = 0;          // --align: шаг смещений совпадений в байтах (0 - любое смещение)
+
+// Участок конкретного файла: смещение и длина в файле, положение в буфере
+typedef struct {
+    off_t off;
+    size_t len;
+    size_t pos;
+} file_seg;
+
+// Состояние обработки одного файла: содержимое читается при первом обращении
+enum { CTX_NONE, CTX_LOADED, CTX_LARGE, CTX_FAILED };
+
+typedef struct {
+    const char *path;
+    io_buf *buf;
+    int state;                  // CTX_*
+    const unsigned char *data;  // Содержимое файла при CTX_LOADED: buf->data или отображение
+    ssize_t len;                // Длина данных при CTX_LOADED
+    void *map;                  // Отображение файла (NULL - данные в buf)
+    struct timespec cpu_mark;   // Процессорное время потока на момент последнего учёта
+    file_seg segs[RANGE_MAX];   // Проверяемые участки (без --range - весь файл)
+    size_t segs_len;
+    off_t size;                 // Размер файла
+    signed char *memo;          // Вычисленные значения узлов (-1 - не вычислен)
+} eval_ctx;
+
+// Пул потоков для плагинов в адресном пространстве хоста
+#define POOL_QUEUE 256
+pthread_t *pool_threads = NULL; // Потоки пула
+int pool_cnt = 0;               // Размер пула (0 - плагины вызываются в потоке обхода)
+struct {
+    char *path;
+    unsigned long seq;          // Номер файла в порядке обхода
+} pool_queue[POOL_QUEUE];       // Очередь путей, ожидающих обработки
+int pool_head = 0, pool_len = 0;
+int pool_busy = 0;              // Файлов в обработке
+int pool_stopping = 0;
+pthread_mutex_t pool_mx = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t pool_nonempty = PTHREAD_COND_INITIALIZER;
+pthread_cond_t pool_nonfull = PTHREAD_COND_INITIALIZER;
+pthread_cond_t pool_idle = PTHREAD_COND_INITIALIZER;
+pthread_mutex_t out_mx = PTHREAD_MUTEX_INITIALIZER;    // Запись в stdout и контрольную точку
+pthread_cond_t order_ready = PTHREAD_COND_INITIALIZER; // Готов файл окна упорядочивания (под out_mx)
+
+// Приёмник результатов. Записи форматируются в буфер потока, который их нашёл,
+// и уходят в stdout одним write() при заполнении буфера, поэтому потоки не
+// синхронизируются на каждом результате. Без --unordered записи файла кладутся в
+// окно по номеру файла, и поток обхода выводит окно подряд в порядке обхода.
+// При контрольной точке буферы сбрасываются только после записи точки.
+enum { FMT_TEXT, FMT_NUL, FMT_JSONL, FMT_BINARY };
+#define SINK_FLUSH (256 * 1024)
+
+// Двоичный формат: заголовок SINK_MAGIC, число запросов (uint32) и их
+// идентификаторы (uint16 длина + байты), затем записи: uint32 длина пути,
+// uint16 номер запроса, uint16 0, байты пути. Числа в порядке байт машины.
+#define SINK_MAGIC "LAB1RES\x01"
+
+typedef struct {
+    char *data;
+    size_t len, cap;
+} out_buf;
+
+typedef struct {
+    out_buf ob;                 // Записи файла
+    out_buf ck;                 // Строки "M ..." файла для контрольной точки
+    char *rel;                  // Относительный путь файла (кандидат во фронт)
+    atomic_int ready;           // Файл обработан, записи можно выводить
+} order_slot;
+
+int sink_format = FMT_TEXT;
+char *format_arg = NULL;        // Значение --format
+int sink_ordered = 1;           // Вывод в порядке обхода (--unordered отключает)
+out_buf sink_main;              // Буфер потока обхода (и хоста в изолированном режиме)
+out_buf *sink_bufs = NULL;      // Буферы потоков пула
+int sink_bufs_cnt = 0;
+order_slot *order_win = NULL;   // Окно упорядочивания
+size_t order_win_len = 0;
+unsigned long order_next = 0;   // Следующий выводимый номер файла
+unsigned long order_seq = 0;    // Следующий номер файла при обходе
+
+// Проверка имени файла разделяемой библиотеки: *.so или *.so.<версия>
+static int is_shared_lib(const char *fpath) {
+    const char *name = strrchr(fpath, '/');
+    name = name ? name + 1 : fpath;
+    for (const char *ext = strstr(name, ".so"); ext; ext = strstr(ext + 1, ".so")) {
+        if (ext == name)
+            continue;
+        const char *tail = ext + 3;
+        if (*tail == '.' && tail[1] != '\0')
+            tail += strspn(tail, "0123456789.");
+        if (*tail == '\0')
+            return 1;
+    }
+    return 0;
+}
+
+// Загрузка библиотеки плагина p->path: dlopen(), согласование версии и получение информации
+int plugin_open(dynamic_lib *p) {
+    const char *fpath = p->path;
+
+    // Открытие разделяемой библиотеки
+    void *library = dlopen(fpath, RTLD_LAZY);
+    if (!library) {
+        // В случае ошибки открытия вывод сообщения и продолжение поиска
+        fprintf(stderr, "dlopen() failed for %s: %s\n", fpath, dlerror());
+        return -1;
+    }
+
+    // Получение указателей на функции плагина
+    void* pi_f = dlsym(library, "plugin_get_info");
+    if (!pi_f) {
+        // В случае отсутствия функции plugin_get_info вывод сообщения об ошибке
+        fprintf(stderr, "dlsym() failed for plugin_get_info: %s\n", dlerror());
+        dlclose(library);
+        return -1;
+    } 
+    
+    void* pf_f = dlsym(library, "plugin_process_file");
+    if (!pf_f) {
+        // В случае отсутствия функции plugin_process_file вывод сообщения об ошибке
+        fprintf(stderr, "dlsym() failed for plugin_process_file: %s\n", dlerror());
+        dlclose(library);
+        return -1;
+    }
+
+    // Согласование версии ABI: плагин без plugin_negotiate() - версии 1
+    int version = 1;
+    void* ng_f = dlsym(library, "plugin_negotiate");
+    if (ng_f)
+        version = ((png_func_t)ng_f)(PLUGIN_API_VERSION);
+    if (version < 1 || version > PLUGIN_API_VERSION) {
+        fprintf(stderr, "Unsupported plugin API version %d in %s\n", version, fpath);
+        dlclose(library);
+        return -1;
+    }
+
+    // Вызов функции plugin_get_info для получения информации о плагине
+    struct plugin_info pi = {0};
+    pgi_func_t pgi = (pgi_func_t)pi_f;
+    int tmp = pgi(&pi);
+    if (tmp == -1) {
+        // В случае ошибки в plugin_get_info вывод сообщения об ошибке
+        fprintf(stderr, "Error in plugin_get_info\n");
+        dlclose(library);
+        return -1;
+    }
+
+    // Совместимость с версией 1: возможностей нет, вызывается только plugin_process_file()
+    if (version == 1) {
+        pi.api_version = 1;
+        pi.caps = 0;
+        pi.cost_per_byte = 0;
+    }
+
+    // Заявленные возможности проверяются по наличию функций
+    void* pb_f = NULL;
+    void* so_f = NULL, *sf_f = NULL, *sc_f = NULL, *sr_f = NULL;
+    if (pi.caps & PLUGIN_CAP_BUFFER) {
+        pb_f = dlsym(library, "plugin_process_buffer");
+        if (!pb_f)
+            pi.caps &= ~PLUGIN_CAP_BUFFER;
+    }
+    if (pi.caps & PLUGIN_CAP_STREAM) {
+        so_f = dlsym(library, "plugin_stream_open");
+        sf_f = dlsym(library, "plugin_stream_feed");
+        sc_f = dlsym(library, "plugin_stream_close");
+        if (!so_f || !sf_f || !sc_f) {
+            pi.caps &= ~PLUGIN_CAP_STREAM;
+            so_f = sf_f = sc_f = NULL;
+        }
+    }
+    if ((pi.caps & PLUGIN_CAP_REGION) && (pi.caps & PLUGIN_CAP_STREAM))
+        sr_f = dlsym(library, "plugin_stream_open_region");
+    if (!sr_f)
+        pi.caps &= ~PLUGIN_CAP_REGION;
+
+    p->pi = pi;
+    p->ppf = (ppf_func_t)pf_f;
+    p->lib = library;
+    p->pbf = (pbf_func_t)pb_f;
+    p->pso = (pso_func_t)so_f;
+    p->psf = (psf_func_t)sf_f;
+    p->psc = (psc_func_t)sc_f;
+    p->psr = (psr_func_t)sr_f;
+    return 0;
+}
+
 // Реализация функции open_func
 int open_func(const char *fpath, const struct stat *sb, int typeflag) {
-    // Проверка использования всех параметров для предотвращения предупреждений компилятора
-    (void) sb;
-    (void) typeflag;
-
     // Проверка корректности пути к файлу
     if (!fpath) {
         fprintf(stderr, "Invalid file path\n");
@@ -47,115 +584,416 @@ int open_func(const char *fpath, const struct stat *sb, int typeflag) {
     }
 
     // Проверка, является ли файл разделяемой библиотекой
-    if (typeflag == FTW_F && strstr(fpath, ".so") != NULL) {
-        // Открытие разделяемой библиотеки
-        void *library = dlopen(fpath, RTLD_LAZY);
-        if (!library) {
-            // В случае ошибки открытия вывод сообщения и продолжение поиска
-            fprintf(stderr, "dlopen() failed for %s: %s\n", fpath, dlerror());
-            return 0;
-        } else {
-            // Получение указателей на функции плагина
-            void* pi_f = dlsym(library, "plugin_get_info");
-            if (!pi_f) {
-                // В случае отсутствия функции plugin_get_info вывод сообщения об ошибке
-                fprintf(stderr, "dlsym() failed for plugin_get_info: %s\n", dlerror());
-                dlclose(library);
-                return 0;
-            } 
-            
-            void* pf_f = dlsym(library, "plugin_process_file");
-            if (!pf_f) {
-                // В случае отсутствия функции plugin_process_file вывод сообщения об ошибке
-                fprintf(stderr, "dlsym() failed for plugin_process_file: %s\n", dlerror());
-                dlclose(library);
-                return 0;
-            }
+    if (typeflag == FTW_F && is_shared_lib(fpath)) {
+        dynamic_lib lib = {0};
+        lib.path = strdup(fpath);
+        lib.sb = *sb;
 
-            // Вызов функции plugin_get_info для получения информации о плагине
-            struct plugin_info pi = {0};
-            pgi_func_t pgi = (pgi_func_t)pi_f;
-            int tmp = pgi(&pi);
-            if (tmp == -1) {
-                // В случае ошибки в plugin_get_info вывод сообщения об ошибке
-                fprintf(stderr, "Error in plugin_get_info\n");
-                dlclose(library);
+        // Плагин, описание которого есть в манифесте, не загружается до первого использования
+        const manifest_entry *me = manifest_find(fpath, sb);
+        if (me) {
+            lib.pi = me->pi;
+            manifest_hits++;
+        } else {
+            if (plugin_open(&lib) == -1) {
+                free(lib.path);
                 return 0;
             }
-
-            // Выделение памяти для массива плагинов и добавление информации о плагине
-            plugins = realloc(plugins, sizeof(dynamic_lib) * (plug_cnt + 1));
-            plugins[plug_cnt].pi = pi;
-            plugins[plug_cnt].ppf = (ppf_func_t)pf_f;
-            plugins[plug_cnt].lib = library;
-            plugins[plug_cnt].in_opts = NULL;
-            plugins[plug_cnt].in_opts_len = 0;
-            plug_cnt++;
-            found_opts += pi.sup_opts_len;
+            manifest_dirty = 1;
         }
+
+        // Выделение памяти для массива плагинов и добавление информации о плагине
+        plugins = realloc(plugins, sizeof(dynamic_lib) * (plug_cnt + 1));
+        plugins[plug_cnt] = lib;
+        plug_cnt++;
+        found_opts += lib.pi.sup_opts_len;
     }
     
     return 0; // Возвращение 0 для продолжения обхода каталога
 }
 
+// Загрузка плагинов, опции которых указаны в командной строке или в выражении
+int load_used_plugins(void) {
+    for (int i = 0; i < plug_cnt; i++) {
+        if (!plugins[i].used || plugins[i].lib)
+            continue;
+        if (plugin_open(&plugins[i]) == -1) {
+            fprintf(stderr, "Plugin %s cannot be loaded\n", plugins[i].path);
+            return -1;
+        } else if (getenv("LAB1DEBUG") != NULL) {
+            fprintf(stderr, "Loaded plugin %s\n", plugins[i].path);
+        }
+    }
+    return 0;
+}
+
+// Имя файла манифеста для каталога плагинов:
+// $XDG_CACHE_HOME/lab1vslN3245/plugins-<хеш пути> (или ~/.cache/...)
+static char *manifest_name(const char *dir) {
+    if (getenv("LAB1NOCACHE") != NULL)
+        return NULL;
+
+    char base[PATH_MAX];
+    const char *xdg = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    if (xdg && *xdg)
+        snprintf(base, sizeof(base), "%s/lab1vslN3245", xdg);
+    else if (home && *home)
+        snprintf(base, sizeof(base), "%s/.cache/lab1vslN3245", home);
+    else
+        return NULL;
+
+    char real[PATH_MAX];
+    if (!realpath(dir, real))
+        return NULL;
+    unsigned long long h = 1469598103934665603ULL;
+    for (const unsigned char *c = (const unsigned char *)real; *c; c++) {
+        h ^= *c;
+        h *= 1099511628211ULL;
+    }
+
+    // Создание каталога кеша (и ~/.cache при необходимости)
+    char *slash = strrchr(base, '/');
+    *slash = '\0';
+    mkdir(base, 0755);
+    *slash = '/';
+    if (mkdir(base, 0755) == -1 && errno != EEXIST)
+        return NULL;
+
+    char *name = malloc(strlen(base) + 32);
+    sprintf(name, "%s/plugins-%016llx", base, h);
+    return name;
+}
+
+// Поиск плагина в манифесте: запись годится, только если файл не менялся
+const manifest_entry *manifest_find(const char *fpath, const struct stat *sb) {
+    for (size_t i = 0; i < manifest_len; i++) {
+        const manifest_entry *me = &manifest[i];
+        if (me->ino == (unsigned long long)sb->st_ino && me->size == (long long)sb->st_size
+                && me->mtime_sec == (long long)sb->st_mtim.tv_sec && me->mtime_nsec == (long long)sb->st_mtim.tv_nsec
+                && strcmp(me->path, fpath) == 0)
+            return me;
+    }
+    return NULL;
+}
+
+// Разбиение строки манифеста на поля по табуляции
+static size_t split_fields(char *line, char **fields, size_t max) {
+    size_t n = 0;
+    while (n < max) {
+        fields[n++] = line;
+        line = strchr(line, '\t');
+        if (!line)
+            break;
+        *line++ = '\0';
+    }
+    return n;
+}
+
+// Загрузка манифеста. Формат - строки с полями через табуляцию:
+//   P <путь> <mtime сек> <mtime нс> <размер> <inode> <версия API> <caps> <стоимость> <число опций> <назначение> <автор>
+//   O <имя> <has_arg> <описание>      (по строке на каждую опцию плагина)
+void manifest_load(void) {
+    FILE *f = fopen(manifest_file, "r");
+    if (!f)
+        return;
+
+    struct stat sb;
+    if (fstat(fileno(f), &sb) == -1 || sb.st_size == 0) {
+        fclose(f);
+        return;
+    }
+    manifest_text = malloc(sb.st_size + 1);
+    size_t len = fread(manifest_text, 1, sb.st_size, f);
+    manifest_text[len] = '\0';
+    fclose(f);
+
+    char *line = manifest_text;
+    manifest_entry *cur = NULL;
+    size_t cur_opts = 0;
+    while (line && *line) {
+        char *next = strchr(line, '\n');
+        if (next)
+            *next++ = '\0';
+
+        char *fl[12];
+        size_t n = split_fields(line, fl, 12);
+        if (n == 12 && !strcmp(fl[0], "P")) {
+            // Запись с неполным списком опций не используется
+            if (cur && cur_opts != cur->pi.sup_opts_len)
+                cur->path = "";
+            manifest = realloc(manifest, (manifest_len + 1) * sizeof(manifest_entry));
+            cur = &manifest[manifest_len++];
+            memset(cur, 0, sizeof(*cur));
+            cur->path = fl[1];
+            cur->mtime_sec = atoll(fl[2]);
+            cur->mtime_nsec = atoll(fl[3]);
+            cur->size = atoll(fl[4]);
+            cur->ino = strtoull(fl[5], NULL, 10);
+            cur->pi.api_version = atoi(fl[6]);
+            cur->pi.caps = strtoul(fl[7], NULL, 10);
+            cur->pi.cost_per_byte = strtod(fl[8], NULL);
+            cur->pi.sup_opts_len = strtoul(fl[9], NULL, 10);
+            cur->pi.sup_opts = calloc(cur->pi.sup_opts_len + 1, sizeof(struct plugin_option));
+            cur->pi.plugin_purpose = fl[10];
+            cur->pi.plugin_author = fl[11];
+            cur_opts = 0;
+        } else if (n == 4 && !strcmp(fl[0], "O") && cur && cur_opts < cur->pi.sup_opts_len) {
+            struct plugin_option *po = &cur->pi.sup_opts[cur_opts++];
+            po->opt.name = fl[1];
+            po->opt.has_arg = atoi(fl[2]);
+            po->opt_descr = fl[3];
+        }
+        line = next;
+    }
+    if (cur && cur_opts != cur->pi.sup_opts_len)
+        cur->path = "";
+}
+
+// Можно ли описать плагин в манифесте: опции без flag и строки без табуляций и переводов строки
+static int plugin_cacheable(const dynamic_lib *p) {
+    const char *strs[3] = { p->path, p->pi.plugin_purpose, p->pi.plugin_author };
+    for (int i = 0; i < 3; i++)
+        if (!strs[i] || strpbrk(strs[i], "\t\n"))
+            return 0;
+    for (size_t j = 0; j < p->pi.sup_opts_len; j++) {
+        const struct plugin_option *po = &p->pi.sup_opts[j];
+        if (po->opt.flag || !po->opt.name || strpbrk(po->opt.name, "\t\n")
+                || (po->opt_descr && strpbrk(po->opt_descr, "\t\n")))
+            return 0;
+    }
+    return 1;
+}
+
+// Запись манифеста по текущему списку плагинов (через временный файл и rename())
+void manifest_save(void) {
+    char tmp_name[PATH_MAX];
+    snprintf(tmp_name, sizeof(tmp_name), "%s.%d", manifest_file, (int)getpid());
+    FILE *f = fopen(tmp_name, "w");
+    if (!f)
+        return;
+
+    for (int i = 0; i < plug_cnt; i++) {
+        const dynamic_lib *p = &plugins[i];
+        if (!plugin_cacheable(p))
+            continue;
+        fprintf(f, "P\t%s\t%lld\t%lld\t%lld\t%llu\t%d\t%u\t%g\t%zu\t%s\t%s\n", p->path,
+                (long long)p->sb.st_mtim.tv_sec, (long long)p->sb.st_mtim.tv_nsec, (long long)p->sb.st_size,
+                (unsigned long long)p->sb.st_ino, p->pi.api_version, p->pi.caps, p->pi.cost_per_byte,
+                p->pi.sup_opts_len, p->pi.plugin_purpose, p->pi.plugin_author);
+        for (size_t j = 0; j < p->pi.sup_opts_len; j++) {
+            const struct plugin_option *po = &p->pi.sup_opts[j];
+            fprintf(f, "O\t%s\t%d\t%s\n", po->opt.name, po->opt.has_arg, po->opt_descr ? po->opt_descr : "");
+        }
+    }
+
+    if (fclose(f) != 0 || rename(tmp_name, manifest_file) == -1)
+        unlink(tmp_name);
+}
+
+// Освобождение манифеста
+void manifest_free(void) {
+    for (size_t i = 0; i < manifest_len; i++)
+        free(manifest[i].pi.sup_opts);
+    free(manifest);
+    free(manifest_text);
+    free(manifest_file);
+    manifest = NULL;
+    manifest_text = NULL;
+    manifest_file = NULL;
+    manifest_len = 0;
+    manifest_dirty = 0;
+    manifest_hits = 0;
+}
+
 // Главная функция
 int main(int argc, char *argv[]) {
     open_dyn_libs("./"); // Открытие динамических библиотек в текущем каталоге
     optparse(argc, argv); // Разбор параметров командной строки
 
+    // Компиляция запросов, выражения или опций -A/-O/-N в граф решений
+    if ((expr_arg || queries_arg) && got_opts > 0) {
+        fprintf(stderr, "Plugin options cannot be combined with --expr or --queries\n");
+        free_plugins();
+        exit(EXIT_FAILURE);
+    }
+    if (expr_arg && queries_arg) {
+        fprintf(stderr, "--expr cannot be combined with --queries\n");
+        free_plugins();
+        exit(EXIT_FAILURE);
+    }
+    if ((expr_arg || queries_arg) && got_logic) {
+        fprintf(stderr, "-A, -O and -N cannot be combined with --expr or --queries\n");
+        free_plugins();
+        exit(EXIT_FAILURE);
+    }
+    int compiled;
+    if (queries_arg)
+        compiled = queries_load(queries_arg);
+    else
+        compiled = expr_add_root(expr_arg ? expr_compile(expr_arg) : expr_compile_legacy(), NULL);
+
     // Проверка наличия опций. Если опции не найдены, вывод сообщения и завершение
-    if (got_opts == 0) {
-        printf("No options found. Use -h for help\n");
+    if (got_opts == 0 || compiled < 0) {
+        if (got_opts == 0)
+            printf("No options found. Use -h for help\n");
 
         // Освобождение выделенной памяти и закрытие открытых библиотек
-        if (plugins) {
-            for (int i = 0; i < plug_cnt; i++) {
-                if (plugins[i].in_opts) free(plugins[i].in_opts);
-                dlclose(plugins[i].lib);
-            }
-            free(plugins);
-        }
+        expr_free();
+        free_plugins();
+        exit(EXIT_FAILURE);
+    }
+
+    // Загрузка только тех плагинов, которые участвуют в выражении
+    if (load_used_plugins() == -1) {
+        expr_free();
+        free_plugins();
+        exit(EXIT_FAILURE);
+    }
+    // Неверные опции плагинов обнаруживаются до обхода
+    if (expr_check() == -1) {
+        expr_free();
+        free_plugins();
+        exit(EXIT_FAILURE);
+    }
+    region_check();
+
+    // Открытие файла контрольной точки (при --resume дописывается тот же файл)
+    if (ckpt_name && ckpt_open(ckpt_name) == -1) {
+        free_plugins();
+        exit(EXIT_FAILURE);
+    }
+
+    // Рабочие процессы однопоточны: pool_cnt сбрасывается до fork(), иначе они
+    // блокировали бы мьютексы плагинов, которые инициализирует только pool_start()
+    if (iso_cnt > 0 && pool_cnt > 0) {
+        fprintf(stderr, "--threads is ignored with --isolate\n");
+        pool_cnt = 0;
+    }
+
+    // --io mmap: SIGBUS от укороченного файла обрабатывается в потоке, который
+    // обращался к отображению; рабочие процессы наследуют обработчик
+    if (io_mode == IO_MMAP) {
+        struct sigaction sa = { .sa_handler = io_bus };
+        sigaction(SIGBUS, &sa, NULL);
+    }
+
+    // Запуск рабочих процессов после разбора опций: они наследуют загруженные плагины
+    if (throttle_start() == -1 || (iso_cnt > 0 && iso_start(iso_cnt) == -1)) {
+        ckpt_close();
+        free_plugins();
+        exit(EXIT_FAILURE);
+    }
+    if (sink_start(format_arg) == -1 || (pool_cnt > 0 && pool_start(pool_cnt) == -1)) {
+        iso_stop();
+        ckpt_close();
+        free_plugins();
         exit(EXIT_FAILURE);
     }
 
     // Обход каталога, указанного в последнем аргументе командной строки
+    if (snap_name)
+        snap_load(snap_name);
     walk_dir(argv[argc-1]);
+    if (snap_name)
+        snap_save();
 
     // Освобождение выделенной памяти и закрытие открытых библиотек
+    pool_stop();
+    iso_stop();
+    ckpt_close();
+    sink_stop();
+    throttle_stop();
+    snap_free();
+    expr_free();
+    free_plugins();
+
+    return EXIT_SUCCESS; // Возвращение кода успешного завершения
+}
+
+// Освобождение опций плагинов и закрытие библиотек
+void free_plugins(void) {
     if (plugins) {
         for (int i = 0; i < plug_cnt; i++) {
             if (plugins[i].in_opts) free(plugins[i].in_opts);
-            dlclose(plugins[i].lib);
+            if (plugins[i].lib) dlclose(plugins[i].lib);
+            free(plugins[i].path);
         }
         free(plugins);
-    }   
+    }
+    plugins = NULL;
+    plug_cnt = 0;
+    found_opts = 0;
 
-    return EXIT_SUCCESS; // Возвращение кода успешного завершения
+    // Строки плагинов из манифеста больше не используются
+    manifest_free();
 }
 
 // Функция открытия динамических библиотек
 void open_dyn_libs(const char *dir){
+    // Описания плагинов из манифеста, новые плагины загружаются и дописываются в него
+    manifest_free();
+    manifest_file = manifest_name(dir);
+    if (manifest_file)
+        manifest_load();
+
     int res = ftw(dir, open_func, 10); // Открытие плагинов
     if (res < 0) {
         fprintf(stderr, "ftw() failed: %s\n", strerror(errno));
     }
+
+    if (manifest_file && (manifest_dirty || manifest_hits != manifest_len))
+        manifest_save();
 }
 
 void display_usage(const char *program_name) {
     printf("\nUsage: %s <options> <dir>\n", program_name);
     printf("<dir> - Directory to search\n");
     printf("\nAvailable options:\n");
-    printf("  -P <dir>    Change plugin directory\n");
+    printf("  -P <dir>    Change plugin directory (set LAB1NOCACHE to bypass the plugin manifest cache)\n");
     printf("  -h          Display this help message\n");
     printf("  -A          Use 'and' logical operation\n");
     printf("  -O          Use 'or' logical operation\n");
     printf("  -N          Use 'not' logical operation\n");
+    printf("  --shard i/N Process only files of shard i out of N (by hash of relative path)\n");
+    printf("  --checkpoint <file>  Periodically save scan progress to <file>\n");
+    printf("  --resume <file>      Continue an interrupted scan from checkpoint <file>\n");
+    printf("  --isolate <n>        Run plugins in <n> isolated worker processes\n");
+    printf("  --file-timeout <s>   With --isolate, kill a worker stuck on one file for <s>\n");
+    printf("                       seconds and mark the file as failed (default %d, 0 - none)\n", ISO_TIMEOUT_DEFAULT);
+    printf("  --threads <n>        Run plugins in <n> threads (plugins that are not reentrant are serialized)\n");
+    printf("  --expr <expr>        Match files by an expression over plugin options instead of -A/-O/-N,\n");
+    printf("                       e.g. '(bit-seq=0b101 AND NOT bit-seq=0xff) OR bit-seq=0x7f'\n");
+    printf("  --queries <file>     Run several queries in one pass, one per line: '<id> <options>'\n");
+    printf("                       or '<id> --expr <expr>'; results are tagged with the query id\n");
+    printf("  --format <fmt>       Result format: text (default), nul, jsonl or binary\n");
+    printf("  --unordered          With --threads/--isolate, print results as files finish\n");
+    printf("                       instead of in walk order (ignored with --checkpoint)\n");
+    printf("  --io <mode>          File reading: auto (default: by size, large files bypass\n");
+    printf("                       the page cache), pread, mmap or direct (O_DIRECT)\n");
+    printf("  --max-read-rate <r>  Limit reading to r bytes/s (suffixes K, M, G)\n");
+    printf("  --max-iops <n>       Limit reading to n read operations per second\n");
+    printf("  --max-cpu <pct>      Limit plugin CPU time to pct%% of one CPU\n");
+    printf("  --nice <n>           Scheduling priority of the scan (see nice(1))\n");
+    printf("  --ioprio <class>     I/O priority: idle or be:<0-7> (see ionice(1))\n");
+    printf("  --range <start:len>  Check only this part of each file; negative start counts\n");
+    printf("                       from the end, empty len means to the end (repeatable)\n");
+    printf("  --align <n>          Match only at file offsets that are multiples of n bytes\n");
+    printf("  --snapshot <file>    Keep the tree structure in file and skip re-reading\n");
+    printf("                       directories that did not change since the last run\n");
 }
 
 void display_plugins_info() {
     printf("\nPlugin Information:\n");
     for(int i = 0; i < plug_cnt; i++) {
         printf("Plugin purpose: %s\n", plugins[i].pi.plugin_purpose);
+        unsigned int caps = plugins[i].pi.caps;
+        printf("Plugin API: v%d%s%s%s%s%s\n", plugins[i].pi.api_version,
+               caps & PLUGIN_CAP_REENTRANT ? ", reentrant" : "",
+               caps & PLUGIN_CAP_BUFFER ? ", buffers" : "",
+               caps & PLUGIN_CAP_STREAM ? ", streaming" : "",
+               caps & PLUGIN_CAP_MULTI ? ", multiple patterns" : "",
+               caps & PLUGIN_CAP_REGION ? ", regions" : "");
         for(size_t j = 0; j < plugins[i].pi.sup_opts_len; j++) {
             printf("  --%s     %s\n", plugins[i].pi.sup_opts[j].opt.name, plugins[i].pi.sup_opts[j].opt_descr);
         }
@@ -172,17 +1010,8 @@ void display_version() {
 }
 
 void optparse(int argc, char *argv[]) {
-    // Выделение памяти для структур опций
-    struct option *long_options = calloc(found_opts + 1, sizeof(struct option));
-    int copied = 0;
-
-    // Копирование опций из всех плагинов в общий список опций
-    for (int i = 0; i < plug_cnt; i++) {
-        for (size_t j = 0; j < plugins[i].pi.sup_opts_len; j++) {
-            long_options[copied] = plugins[i].pi.sup_opts[j].opt;
-            copied++;
-        }
-    }
+    // Общий список опций плагинов и хоста
+    struct option *long_options = build_long_options();
 
     int option_index = 0;
     int choice;
@@ -195,8 +1024,28 @@ void optparse(int argc, char *argv[]) {
                 for (int i = 0; i < plug_cnt; i++) {
                     for (size_t j = 0; j < plugins[i].pi.sup_opts_len; j++) {
                         if (strcmp(long_options[option_index].name, plugins[i].pi.sup_opts[j].opt.name) == 0) {
+                            // Повтор опции имеет смысл только у плагина с несколькими шаблонами.
+                            // Плагин версии 1 не может заявить PLUGIN_CAP_MULTI и получает все повторы, как раньше.
+                            int repeated = 0;
+                            for (size_t k = 0; k < plugins[i].in_opts_len; k++) {
+                                if (plugins[i].pi.api_version >= 2 && !(plugins[i].pi.caps & PLUGIN_CAP_MULTI) && strcmp(plugins[i].in_opts[k].name, long_options[option_index].name) == 0) {
+                                    fprintf(stderr, "Plugin does not support several --%s values, only the first one is used\n", long_options[option_index].name);
+                                    repeated = 1;
+                                    break;
+                                }
+                            }
+                            if (repeated)
+                                continue;
+
                             // Расширение массива опций для хранения опции
-                            plugins[i].in_opts = realloc(plugins[i].in_opts, (plugins[i].in_opts_len + 1) * sizeof(struct option));
+                            struct option *grown = realloc(plugins[i].in_opts, (plugins[i].in_opts_len + 1) * sizeof(struct option));
+                            if (grown == NULL) {
+                                fprintf(stderr, "Memory allocation failed\n");
+                                free_plugins();
+                                free(long_options);
+                                exit(EXIT_FAILURE);
+                            }
+                            plugins[i].in_opts = grown;
                             plugins[i].in_opts[plugins[i].in_opts_len] = long_options[option_index];
 
                             // Установка флага, если опция имеет аргумент
@@ -213,25 +1062,13 @@ void optparse(int argc, char *argv[]) {
                 display_usage(argv[0]);
                 display_plugins_info();
                 // Освобождение памяти и завершение работы
-                if (plugins) {
-                    for (int i = 0; i < plug_cnt; i++) {
-                        if (plugins[i].in_opts) free(plugins[i].in_opts);
-                        dlclose(plugins[i].lib);
-                    }
-                    free(plugins);
-                }
+                free_plugins();
                 free(long_options);
                 exit(EXIT_SUCCESS);
             case 'v':
                 display_version();
                 // Освобождение памяти и завершение работы
-                if (plugins) {
-                    for (int i = 0; i < plug_cnt; i++) {
-                        if (plugins[i].in_opts) free(plugins[i].in_opts);
-                        dlclose(plugins[i].lib);
-                    }
-                    free(plugins);
-                }
+                free_plugins();
                 free(long_options);
                 exit(EXIT_SUCCESS);
             case 'P':
@@ -244,36 +1081,162 @@ void optparse(int argc, char *argv[]) {
                 }
 
                 // Закрытие текущих библиотек и освобождение памяти
-                for (int i = 0; i < plug_cnt; i++) {
-                    dlclose(plugins[i].lib);
-                }
-                free(plugins);
-                plugins = NULL;
-                plug_cnt = 0;
-                found_opts = 0;
+                free_plugins();
 
                 // Вывод отладочной информации и открытие новых плагинов
                 if (getenv("LAB1DEBUG") != NULL) fprintf(stderr, "New lib path: %s\n", optarg);
                 free(long_options);
                 open_dyn_libs(optarg);
-                long_options = calloc(found_opts + 1, sizeof(struct option));
-                copied = 0;
-                for (int i = 0; i < plug_cnt; i++) {
-                    for (size_t j = 0; j < plugins[i].pi.sup_opts_len; j++) {
-                        long_options[copied] = plugins[i].pi.sup_opts[j].opt;
-                        copied++;
-                    }
-                }
+                long_options = build_long_options();
                 break;
             case 'O':
                 or = 1;
+                got_logic = 1;
                 break;
             case 'A':
                 or = 0;
+                got_logic = 1;
                 break;
             case 'N':
                 not = 1;
+                got_logic = 1;
+                break;
+            case OPT_SHARD:
+                if (parse_shard(optarg) == -1) {
+                    fprintf(stderr, "Invalid --shard value '%s', expected i/N with 0 <= i < N\n", optarg);
+                    free_plugins();
+                    free(long_options);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OPT_CHECKPOINT:
+                ckpt_name = optarg;
+                break;
+            case OPT_RESUME:
+                if (ckpt_load(optarg) == -1) {
+                    free_plugins();
+                    free(long_options);
+                    exit(EXIT_FAILURE);
+                }
+                if (!ckpt_name)
+                    ckpt_name = optarg;
+                break;
+            case OPT_EXPR:
+                expr_arg = optarg;
+                break;
+            case OPT_QUERIES:
+                queries_arg = optarg;
                 break;
+            case OPT_FORMAT:
+                format_arg = optarg;
+                break;
+            case OPT_ORDERED:
+                // Порядок обхода - по умолчанию, опция оставлена для совместимости
+                sink_ordered = 1;
+                break;
+            case OPT_UNORDERED:
+                sink_ordered = 0;
+                break;
+            case OPT_IO:
+                if (!strcmp(optarg, "auto"))
+                    io_mode = IO_AUTO;
+                else if (!strcmp(optarg, "pread"))
+                    io_mode = IO_PREAD;
+                else if (!strcmp(optarg, "mmap"))
+                    io_mode = IO_MMAP;
+                else if (!strcmp(optarg, "direct"))
+                    io_mode = IO_DIRECT;
+                else {
+                    fprintf(stderr, "Unknown --io '%s'\n", optarg);
+                    free_plugins();
+                    free(long_options);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OPT_MAX_READ_RATE:
+            case OPT_MAX_IOPS:
+            case OPT_MAX_CPU: {
+                double *limit = choice == OPT_MAX_READ_RATE ? &max_read_rate
+                              : choice == OPT_MAX_IOPS ? &max_iops : &max_cpu;
+                if (parse_rate(optarg, choice == OPT_MAX_READ_RATE, limit) == -1) {
+                    fprintf(stderr, "Invalid --%s value '%s'\n", long_options[option_index].name, optarg);
+                    free_plugins();
+                    free(long_options);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            }
+            case OPT_NICE: {
+                char *endptr;
+                errno = 0;
+                long val = strtol(optarg, &endptr, 10);
+                if (errno != 0 || endptr == optarg || *endptr != '\0' || val < -20 || val > 19) {
+                    fprintf(stderr, "Invalid --nice value '%s' (expected -20..19)\n", optarg);
+                    free_plugins();
+                    free(long_options);
+                    exit(EXIT_FAILURE);
+                }
+                nice_set = 1;
+                nice_arg = val;
+                break;
+            }
+            case OPT_IOPRIO:
+                ioprio_arg = optarg;
+                break;
+            case OPT_RANGE:
+                if (parse_range(optarg) == -1) {
+                    fprintf(stderr, "Invalid --range value '%s'\n", optarg);
+                    free_plugins();
+                    free(long_options);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OPT_ALIGN: {
+                char *endptr;
+                errno = 0;
+                unsigned long align = strtoul(optarg, &endptr, 0);
+                if (errno != 0 || endptr == optarg || *endptr != '\0' || align == 0 || optarg[0] == '-') {
+                    fprintf(stderr, "Invalid --align value '%s'\n", optarg);
+                    free_plugins();
+                    free(long_options);
+                    exit(EXIT_FAILURE);
+                }
+                scan_align = align;
+                break;
+            }
+            case OPT_SNAPSHOT:
+                snap_name = optarg;
+                break;
+            case OPT_THREADS:
+                pool_cnt = atoi(optarg);
+                if (pool_cnt <= 0) {
+                    fprintf(stderr, "Invalid --threads value '%s'\n", optarg);
+                    free_plugins();
+                    free(long_options);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OPT_ISOLATE:
+                iso_cnt = atoi(optarg);
+                if (iso_cnt <= 0) {
+                    fprintf(stderr, "Invalid --isolate value '%s'\n", optarg);
+                    free_plugins();
+                    free(long_options);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OPT_FILE_TIMEOUT: {
+                char *endptr;
+                errno = 0;
+                iso_timeout = strtol(optarg, &endptr, 10);
+                if (errno != 0 || endptr == optarg || *endptr != '\0' || iso_timeout < 0) {
+                    fprintf(stderr, "Invalid --file-timeout value '%s'\n", optarg);
+                    free_plugins();
+                    free(long_options);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            }
             case '?':
                 break;
         }
@@ -281,57 +1244,2462 @@ void optparse(int argc, char *argv[]) {
     free(long_options);
 }
 
-// Функция для печати информации о найденных файлах
-void print_entry(int type, const char *path) {
-    // Пропуск записей каталога и нерегулярных файлов
-    if (!strcmp(path, ".") || !strcmp(path, "..") || type != FTW_F)
-        return;
+// Построение общего списка длинных опций: опции всех плагинов, затем опции хоста
+struct option *build_long_options(void) {
+    struct option *long_options = calloc(found_opts + host_opts_len + 1, sizeof(struct option));
+    int copied = 0;
 
-    int cnt = 0;
-    int cnt_success = 0;
-    
-    // Итерация по всем плагинам для обработки файла с соответствующими опциями
-    for(int i = 0; i < plug_cnt; i++){
-        // Пропуск плагинов без установленных опций
-        if(plugins[i].in_opts_len > 0){
-            // Вызов функции обработки плагина с указанными опциями
-            int tmp = plugins[i].ppf(path, plugins[i].in_opts, plugins[i].in_opts_len);
-            
-            // Обработка ошибок, если есть
-            if(tmp == -1){
-                fprintf(stderr, "Error in plugin! %s", strerror(errno));
-                // Сброс опций при возникновении ошибки
-                if(errno == EINVAL || errno == ERANGE) 
-                    plugins[i].in_opts_len = 0;
-            } else if (tmp == 0) 
-                cnt++;
-            cnt_success++;
+    // Копирование опций из всех плагинов в общий список опций
+    for (int i = 0; i < plug_cnt; i++) {
+        for (size_t j = 0; j < plugins[i].pi.sup_opts_len; j++) {
+            long_options[copied] = plugins[i].pi.sup_opts[j].opt;
+            copied++;
         }
     }
-    
-    // Проверка выполнения условий 'or' и 'not'
-    if((not && or && (cnt == 0)) || (not && !or && (cnt != cnt_success))){
-        // Печать пути найденного файла
-        printf("Found file: %s\n", path);
-    } else if((!not && or && (cnt > 0)) || (!not && !or && (cnt == cnt_success))){
-        // Печать пути найденного файла
-        printf("Found file: %s\n", path);
+    for (size_t j = 0; j < host_opts_len; j++) {
+        long_options[copied] = host_opts[j];
+        copied++;
     }
-    return;
-} 
+    return long_options;
+}
 
-// Функция обхода каталогов
-int walk_func(const char *fpath, const struct stat *sb, int typeflag) {
-    if(!sb) return -1;
-    print_entry( typeflag, fpath); 
-   
+// Разбор аргумента --shard в формате i/N
+int parse_shard(const char *arg) {
+    // strtoul() принимает знак минус, поэтому числа проверяются на цифру в начале
+    char *endptr;
+    errno = 0;
+    if (*arg < '0' || *arg > '9')
+        return -1;
+    unsigned long idx = strtoul(arg, &endptr, 10);
+    if (errno != 0 || *endptr != '/')
+        return -1;
+
+    const char *cnt_str = endptr + 1;
+    if (*cnt_str < '0' || *cnt_str > '9')
+        return -1;
+    unsigned long cnt = strtoul(cnt_str, &endptr, 10);
+    if (errno != 0 || *endptr != '\0' || cnt == 0 || idx >= cnt)
+        return -1;
+
+    shard_idx = idx;
+    shard_cnt = cnt;
     return 0;
 }
 
-// Функция для обхода каталогов
-void walk_dir(const char *dir) {
-    int res = ftw(dir, walk_func, 10);   
-    if (res < 0) {
-        fprintf(stderr, "ftw() failed: %s\n", strerror(errno));
+// Разбор положительного значения ограничения; с suffixes допускаются K, M, G (по 1024)
+int parse_rate(const char *arg, int suffixes, double *out) {
+    char *endptr;
+    errno = 0;
+    double v = strtod(arg, &endptr);
+    if (errno != 0 || endptr == arg || !(v > 0))
+        return -1;
+    if (suffixes && *endptr) {
+        const char *units = "KMG";
+        const char *u = strchr(units, *endptr);
+        if (!u || endptr[1])
+            return -1;
+        for (int k = 0; k <= u - units; k++)
+            v *= 1024;
+    } else if (*endptr) {
+        return -1;
+    }
+    *out = v;
+    return 0;
+}
+
+// Разбор участка --range start:len
+int parse_range(const char *arg) {
+    if (ranges_len == RANGE_MAX)
+        return -1;
+    char *endptr;
+    errno = 0;
+    long long start = strtoll(arg, &endptr, 0);
+    if (errno != 0 || endptr == arg || *endptr != ':')
+        return -1;
+
+    const char *len_str = endptr + 1;
+    unsigned long long len = 0;
+    if (*len_str) {
+        len = strtoull(len_str, &endptr, 0);
+        if (errno != 0 || endptr == len_str || *endptr != '\0' || len == 0 || *len_str == '-')
+            return -1;
+    }
+    ranges[ranges_len++] = (file_range){ start, len };
+    return 0;
+}
+
+// Предупреждения о плагинах, к которым --range и --align не применимы
+void region_check(void) {
+    if (ranges_len == 0 && scan_align == 0)
+        return;
+    for (int i = 0; i < plug_cnt; i++) {
+        if (!plugins[i].used)
+            continue;
+        if (!plugins[i].pbf && !plugins[i].pso)
+            fprintf(stderr, "Plugin %s reads whole files itself, --range/--align do not apply to it\n", plugins[i].path);
+        else if (scan_align && !plugins[i].psr)
+            fprintf(stderr, "Plugin %s does not support --align, all offsets are checked\n", plugins[i].path);
+    }
+}
+
+// Путь относительно корня обхода
+const char *rel_path(const char *fpath) {
+    const char *rel = fpath + MIN(root_len, strlen(fpath));
+    while (*rel == '/')
+        rel++;
+    return rel;
+}
+
+// Проверка принадлежности файла текущему шарду.
+// Хеш берётся от пути относительно корня обхода, поэтому разбиение не зависит
+// от того, под каким путём дерево смонтировано на конкретной машине.
+int in_shard(const char *fpath) {
+    if (shard_cnt == 1)
+        return 1;
+
+    const char *rel = rel_path(fpath);
+
+    // FNV-1a с финальным перемешиванием (splitmix64), чтобы младшие биты были равномерны
+    unsigned long long h = 1469598103934665603ULL;
+    for (const unsigned char *p = (const unsigned char *)rel; *p; p++) {
+        h ^= *p;
+        h *= 1099511628211ULL;
+    }
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+
+    return h % shard_cnt == shard_idx;
+}
+
+// Расход amount маркеров; при долге поток спит, пока корзина его не восполнит
+static void bucket_take(bucket *b, double amount) {
+    if (b->rate <= 0 || amount <= 0)
+        return;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    // Рабочий процесс могли убить с захваченным мьютексом: состояние корзины
+    // при этом цело (обновления - отдельные поля), её можно использовать дальше
+    if (pthread_mutex_lock(&b->mx) == EOWNERDEAD)
+        pthread_mutex_consistent(&b->mx);
+    double dt = (now.tv_sec - b->last.tv_sec) + (now.tv_nsec - b->last.tv_nsec) / 1e9;
+    if (dt > 0) {
+        b->tokens = MIN(b->tokens + dt * b->rate, b->rate * THROTTLE_BURST);
+        b->last = now;
+    }
+    b->tokens -= amount;
+    double wait = b->tokens < 0 ? -b->tokens / b->rate : 0;
+    pthread_mutex_unlock(&b->mx);
+
+    if (wait > 0) {
+        struct timespec ts = { (time_t)wait, (long)((wait - (time_t)wait) * 1e9) };
+        while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+            ;
+    }
+}
+
+// Учёт чтения: bytes байт за ops операций
+static void throttle_io(size_t bytes, double ops) {
+    if (!throttle)
+        return;
+    bucket_take(&throttle->read, bytes);
+    bucket_take(&throttle->iops, ops);
+}
+
+// Учёт процессорного времени потока, прошедшего с ctx->cpu_mark
+static void throttle_cpu(eval_ctx *ctx) {
+    if (!throttle || throttle->cpu.rate <= 0)
+        return;
+    struct timespec now;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    double used = (now.tv_sec - ctx->cpu_mark.tv_sec) + (now.tv_nsec - ctx->cpu_mark.tv_nsec) / 1e9;
+    bucket_take(&throttle->cpu, used);
+    ctx->cpu_mark = now;
+}
+
+// Предел процессора по cpu.max группы cgroup v2 процесса, в процессорах (0 - нет предела)
+static double cgroup_cpu_limit(void) {
+    FILE *f = fopen("/proc/self/cgroup", "r");
+    if (!f)
+        return 0;
+    char line[PATH_MAX], fname[PATH_MAX + 64];
+    fname[0] = '\0';
+    while (fgets(line, sizeof(line), f)) {
+        if (strncmp(line, "0::", 3) == 0) {
+            line[strcspn(line, "\n")] = '\0';
+            snprintf(fname, sizeof(fname), "/sys/fs/cgroup%s/cpu.max", line + 3);
+            break;
+        }
+    }
+    fclose(f);
+    if (!fname[0] || !(f = fopen(fname, "r")))
+        return 0;
+    double quota = 0, period = 0;
+    if (fscanf(f, "%lf %lf", &quota, &period) != 2 || period <= 0)
+        quota = 0;
+    fclose(f);
+    return quota > 0 ? quota / period : 0;
+}
+
+// Настройка ограничений до запуска потоков и рабочих процессов, чтобы они
+// унаследовали приоритеты и общую память корзин
+int throttle_start(void) {
+    if (nice_set && setpriority(PRIO_PROCESS, 0, nice_arg) == -1)
+        fprintf(stderr, "setpriority() failed: %s\n", strerror(errno));
+
+    if (ioprio_arg) {
+        int prio;
+        char *endptr;
+        if (!strcmp(ioprio_arg, "idle")) {
+            prio = IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE, 0);
+        } else if (!strncmp(ioprio_arg, "be:", 3)) {
+            long level = strtol(ioprio_arg + 3, &endptr, 10);
+            if (endptr == ioprio_arg + 3 || *endptr || level < 0 || level > 7) {
+                fprintf(stderr, "Invalid --ioprio value '%s'\n", ioprio_arg);
+                return -1;
+            }
+            prio = IOPRIO_PRIO_VALUE(IOPRIO_CLASS_BE, level);
+        } else {
+            fprintf(stderr, "Invalid --ioprio value '%s'\n", ioprio_arg);
+            return -1;
+        }
+        if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, prio) == -1)
+            fprintf(stderr, "ioprio_set() failed: %s\n", strerror(errno));
+    }
+
+    if (max_read_rate <= 0 && max_iops <= 0 && max_cpu <= 0)
+        return 0;
+
+    // Предел выше квоты cgroup бесполезен: ядро остановит группу раньше,
+    // и вместо ровных коротких пауз будут длинные простои до конца периода
+    double cpus = cgroup_cpu_limit();
+    if (max_cpu > 0 && cpus > 0 && max_cpu / 100 > cpus) {
+        fprintf(stderr, "--max-cpu lowered to the cgroup limit of %.0f%%\n", cpus * 100);
+        max_cpu = cpus * 100;
+    }
+
+    throttle = mmap(NULL, sizeof(throttle_state), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (throttle == MAP_FAILED) {
+        fprintf(stderr, "mmap() failed: %s\n", strerror(errno));
+        throttle = NULL;
+        return -1;
+    }
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    bucket *b[] = { &throttle->read, &throttle->iops, &throttle->cpu };
+    double rates[] = { max_read_rate, max_iops, max_cpu / 100 };
+    for (int k = 0; k < 3; k++) {
+        b[k]->rate = rates[k];
+        b[k]->tokens = rates[k] * THROTTLE_BURST;
+        clock_gettime(CLOCK_MONOTONIC, &b[k]->last);
+        pthread_mutex_init(&b[k]->mx, &attr);
+    }
+    pthread_mutexattr_destroy(&attr);
+    return 0;
+}
+
+void throttle_stop(void) {
+    if (throttle)
+        munmap(throttle, sizeof(throttle_state));
+    throttle = NULL;
+}
+
+// Выделение буфера не меньше size байт, выровненного по IO_ALIGN.
+// Содержимое не сохраняется.
+static int io_reserve(io_buf *buf, size_t size) {
+    if (size <= buf->cap && buf->data)
+        return 0;
+    size_t cap = (MAX(size, (size_t)IO_ALIGN) + IO_ALIGN - 1) & ~(size_t)(IO_ALIGN - 1);
+    void *data;
+    if (posix_memalign(&data, IO_ALIGN, cap) != 0)
+        return -1;
+    free(buf->data);
+    buf->data = data;
+    buf->cap = cap;
+    return 0;
+}
+
+// Включение O_DIRECT для открытого файла. Возвращает 1, если чтение идёт мимо кэша.
+static int io_direct(int fd) {
+    int fl = fcntl(fd, F_GETFL);
+    return fl != -1 && fcntl(fd, F_SETFL, fl | O_DIRECT) == 0;
+}
+
+// Чтение блока с позиции off. При O_DIRECT длина округляется вверх до IO_ALIGN
+// (буфер выделен с запасом); если ФС отказывает в прямом чтении, файл читается через кэш.
+static ssize_t io_pread(int fd, unsigned char *data, size_t len, off_t off, int *direct) {
+    for (;;) {
+        size_t want = *direct ? (len + IO_ALIGN - 1) & ~(size_t)(IO_ALIGN - 1) : len;
+        ssize_t n = pread(fd, data, want, off);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1 && *direct && errno == EINVAL) {
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+            *direct = 0;
+            continue;
+        }
+        if (n > 0)
+            throttle_io(n, 1);
+        return n == -1 ? -1 : (ssize_t)MIN((size_t)n, len);
+    }
+}
+
+// Чтение файла в буфер целиком. Возвращает число прочитанных байт или -1.
+static ssize_t read_whole(int fd, size_t size, io_buf *buf, int direct) {
+    if (io_reserve(buf, size + (direct ? IO_ALIGN : 0)) == -1)
+        return -1;
+
+    size_t total = 0;
+    while (total < size) {
+        // Прямое чтение возможно только с выровненной позиции
+        if (direct && total % IO_ALIGN) {
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+            direct = 0;
+        }
+        ssize_t n = io_pread(fd, buf->data + total, size - total, total, &direct);
+        if (n == -1)
+            return -1;
+        if (n == 0)
+            break;
+        total += n;
+    }
+    return total;
+}
+
+// Блокировка плагина, который нельзя вызывать одновременно из нескольких потоков
+static void plugin_lock(int i) {
+    if (pool_cnt > 0 && !(plugins[i].pi.caps & PLUGIN_CAP_REENTRANT))
+        pthread_mutex_lock(&plugins[i].lock);
+}
+
+static void plugin_unlock(int i) {
+    if (pool_cnt > 0 && !(plugins[i].pi.caps & PLUGIN_CAP_REENTRANT))
+        pthread_mutex_unlock(&plugins[i].lock);
+}
+
+// Способ чтения файла размера size
+static int io_pick(off_t size) {
+    if (io_mode != IO_AUTO)
+        return io_mode;
+    return size <= BUF_MAX ? IO_PREAD : IO_AUTO;
+}
+
+// Запоминание, какие страницы участка [off, off + len) уже в кэше. Отображается
+// только этот участок и только для mincore(), обращений к отображению нет.
+static void io_resident(int fd, io_res *r, off_t off, off_t len) {
+    long page = sysconf(_SC_PAGESIZE);
+    off_t base = off - off % page, map_len = off + len - base;
+    r->off = off;
+    r->len = 0;
+    if (len <= 0 || (map_len + page - 1) / page > (off_t)sizeof(r->vec))
+        return;
+    void *map = mmap(NULL, map_len, PROT_READ, MAP_SHARED, fd, base);
+    if (map == MAP_FAILED)
+        return;
+    if (mincore(map, map_len, r->vec) == 0)
+        r->len = len;
+    munmap(map, map_len);
+}
+
+// Сброс из кэша страниц блоков [from, to) кольца ahead, которых не было в кэше
+// до их чтения; страницы, закэшированные другими процессами, остаются. Если
+// состояние кэша блока неизвестно, он не сбрасывается. Страницы соседних блоков
+// сбрасываются одним вызовом: большая страница кэша (folio) на границе блоков
+// вытесняется, только если участок покрывает её целиком.
+static void io_drop(int fd, const io_res *ahead, size_t from, size_t to) {
+    long page = sysconf(_SC_PAGESIZE);
+    off_t run = 0, run_end = 0;
+    for (size_t c = from; c < to; c++) {
+        const io_res *r = &ahead[c % IO_LOOKAHEAD];
+        off_t first = r->off / page, last = (r->off + r->len + page - 1) / page;
+        for (off_t p = first; p < last; p++) {
+            // Страница на стыке блоков учитывается один раз
+            if (p < run_end || (r->vec[p - first] & 1))
+                continue;
+            if (p != run_end) {
+                if (run_end > run)
+                    posix_fadvise(fd, run * page, (run_end - run) * page, POSIX_FADV_DONTNEED);
+                run = p;
+            }
+            run_end = p + 1;
+        }
+    }
+    if (run_end > run)
+        posix_fadvise(fd, run * page, (run_end - run) * page, POSIX_FADV_DONTNEED);
+}
+
+// Обработчик SIGBUS для --io mmap: возврат в call_plugin(), если поток
+// обращался к отображению файла, иначе - обычное завершение по сигналу
+void io_bus(int sig) {
+    if (io_bus_jmp)
+        siglongjmp(*io_bus_jmp, 1);
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+// Участки файла размера size по --range (без --range - весь файл)
+static void ctx_segs(eval_ctx *ctx, off_t size) {
+    ctx->segs_len = 0;
+    if (ranges_len == 0) {
+        ctx->segs[ctx->segs_len++] = (file_seg){ 0, size, 0 };
+        return;
+    }
+    size_t pos = 0;
+    for (size_t r = 0; r < ranges_len; r++) {
+        long long start = ranges[r].start < 0 ? size + ranges[r].start : ranges[r].start;
+        start = MIN(MAX(start, 0), (long long)size);
+        unsigned long long len = size - start;
+        if (ranges[r].len > 0)
+            len = MIN(len, ranges[r].len);
+        if (len == 0)
+            continue;
+        ctx->segs[ctx->segs_len++] = (file_seg){ start, len, pos };
+        pos += len;
+    }
+}
+
+// Загрузка содержимого файла при первом обращении плагина к данным.
+// Возвращает 0, если данные в ctx->data; -1, если данные передать нельзя (большой файл или ошибка).
+// С --range читаются только участки файла, подряд друг за другом.
+static int ctx_load(eval_ctx *ctx) {
+    if (ctx->state == CTX_NONE) {
+        ctx->state = CTX_FAILED;
+        int fd = open(ctx->path, O_RDONLY | O_CLOEXEC);
+        struct stat sb;
+        if (fd != -1 && fstat(fd, &sb) == 0) {
+            ctx->size = sb.st_size;
+            ctx_segs(ctx, sb.st_size);
+            size_t total = 0;
+            for (size_t k = 0; k < ctx->segs_len; k++)
+                total += ctx->segs[k].len;
+
+            int mode = io_pick(sb.st_size);
+            if (total > BUF_MAX) {
+                ctx->state = CTX_LARGE;
+            } else if (ranges_len > 0) {
+                ssize_t n = -1;
+                int direct = 0;
+                if (io_reserve(ctx->buf, total) == 0) {
+                    n = 0;
+                    for (size_t k = 0; k < ctx->segs_len && n >= 0; k++) {
+                        file_seg *seg = &ctx->segs[k];
+                        size_t got = 0;
+                        while (got < seg->len && (n = io_pread(fd, ctx->buf->data + seg->pos + got, seg->len - got, seg->off + got, &direct)) > 0)
+                            got += n;
+                        // Файл укоротился после fstat()
+                        seg->len = got;
+                    }
+                }
+                if (n >= 0) {
+                    ctx->data = ctx->buf->data;
+                    ctx->len = total;
+                    ctx->state = CTX_LOADED;
+                }
+            } else if (mode == IO_MMAP && sb.st_size > 0) {
+                ctx->map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (ctx->map == MAP_FAILED) {
+                    ctx->map = NULL;
+                    mode = IO_PREAD;
+                } else {
+                    madvise(ctx->map, sb.st_size, MADV_SEQUENTIAL);
+                    // Страницы прочитаются при обращении; учитываются сразу, по операции на блок
+                    throttle_io(sb.st_size, (sb.st_size + STREAM_CHUNK - 1) / STREAM_CHUNK);
+                    ctx->data = ctx->map;
+                    ctx->len = sb.st_size;
+                    ctx->state = CTX_LOADED;
+                }
+            }
+            if (ctx->state == CTX_FAILED && ranges_len == 0) {
+                int direct = mode == IO_DIRECT && io_direct(fd);
+                ctx->len = read_whole(fd, sb.st_size, ctx->buf, direct);
+                if (ctx->len >= 0) {
+                    ctx->data = ctx->buf->data;
+                    ctx->segs[0].len = ctx->len;
+                    ctx->state = CTX_LOADED;
+                }
+            }
+        }
+        if (fd != -1)
+            close(fd);
+    }
+    return ctx->state == CTX_LOADED ? 0 : -1;
+}
+
+// Начало потока плагина i по участку файла с началом off: с --range/--align
+// плагину сообщается положение участка, если он это поддерживает
+static void *region_open(int i, struct option *opts, size_t opts_len, off_t off) {
+    if (plugins[i].psr && (ranges_len > 0 || scan_align > 0))
+        return plugins[i].psr(opts, opts_len, off, scan_align);
+    return plugins[i].pso(opts, opts_len);
+}
+
+// Итог по нескольким участкам: совпадение в любом - успех, иначе ошибка, если она была
+static int region_merge(int acc, int res) {
+    if (acc == 0 || res == 0)
+        return 0;
+    return acc == -1 || res == -1 ? -1 : 1;
+}
+
+// Потоковая обработка большого файла (или его участков) блоками по STREAM_CHUNK
+// сразу для листа n и всех ещё не вычисленных потоковых листьев графа: файл
+// читается один раз, каждый блок передаётся всем открытым потокам. Результаты
+// остальных листьев запоминаются в ctx->memo.
+// Прочитанные блоки не оседают в кэше: либо чтение идёт мимо него (O_DIRECT),
+// либо страницы сбрасываются сразу после передачи плагинам.
+static int stream_leaves(int n, eval_ctx *ctx) {
+    const expr_node *node = &expr_nodes[n];
+    if (io_reserve(ctx->buf, STREAM_CHUNK) == -1)
+        return -1;
+
+    int fd = open(ctx->path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        plugin_lock(node->plugin);
+        int tmp = plugins[node->plugin].ppf(ctx->path, node->opts, node->opts_len);
+        plugin_unlock(node->plugin);
+        return tmp;
+    }
+
+    // Лист n - первый, за ним остальные невычисленные потоковые листья
+    int leaves[expr_len], res[expr_len];
+    void *st[expr_len];
+    size_t cnt = 0;
+    leaves[cnt++] = n;
+    for (size_t m = 0; m < expr_len; m++)
+        if ((int)m != n && expr_nodes[m].op == EXPR_LEAF && plugins[expr_nodes[m].plugin].pso && ctx->memo[m] < 0)
+            leaves[cnt++] = m;
+    for (size_t j = 0; j < cnt; j++)
+        res[j] = 1;
+
+    // Упреждающее чтение ядра отключается: его окно растёт вместе с размером
+    // страниц кэша, и такие страницы не удаётся сбросить поблочно. Вместо него
+    // заранее запрашивается следующий блок.
+    int direct = io_pick(ctx->size) == IO_DIRECT && io_direct(fd);
+    if (!direct)
+        posix_fadvise(fd, 0, 0, POSIX_FADV_RANDOM);
+    // Состояние кэша блоков участка, начиная с текущего (кольцо)
+    io_res ahead[IO_LOOKAHEAD];
+    for (size_t k = 0; k < ctx->segs_len; k++) {
+        // Потоки открываются для листьев, результат которых ещё не определён
+        size_t active = 0;
+        for (size_t j = 0; j < cnt; j++) {
+            const expr_node *leaf = &expr_nodes[leaves[j]];
+            st[j] = NULL;
+            if (res[j] == 0)
+                continue;
+            plugin_lock(leaf->plugin);
+            st[j] = region_open(leaf->plugin, leaf->opts, leaf->opts_len, ctx->segs[k].off);
+            plugin_unlock(leaf->plugin);
+            if (st[j])
+                active++;
+            else
+                res[j] = -1;
+        }
+        if (active == 0)
+            continue;
+
+        ssize_t rd = 0;
+        off_t off = ctx->segs[k].off, end = off + ctx->segs[k].len;
+        size_t cur = 0, rec = 0;    // Номер текущего блока и число блоков с известным состоянием
+        while (active > 0 && off < end) {
+            // Состояние кэша запоминается на IO_LOOKAHEAD - 1 блоков вперёд: метки
+            // упреждающего чтения, оставленные другими процессами, всё равно
+            // подгружают страницы впереди. Предыдущий блок остаётся в кольце.
+            for (; !direct && rec < cur + IO_LOOKAHEAD - 1; rec++) {
+                off_t at = ctx->segs[k].off + (off_t)rec * STREAM_CHUNK;
+                io_resident(fd, &ahead[rec % IO_LOOKAHEAD], at, MIN((off_t)STREAM_CHUNK, ctx->size - at));
+            }
+            if (!direct && off + STREAM_CHUNK < end)
+                posix_fadvise(fd, off + STREAM_CHUNK, MIN((off_t)STREAM_CHUNK, end - off - STREAM_CHUNK), POSIX_FADV_WILLNEED);
+            if ((rd = io_pread(fd, ctx->buf->data, MIN((off_t)STREAM_CHUNK, end - off), off, &direct)) <= 0)
+                break;
+            for (size_t j = 0; j < cnt; j++) {
+                if (!st[j])
+                    continue;
+                int p = expr_nodes[leaves[j]].plugin;
+                plugin_lock(p);
+                int more = plugins[p].psf(st[j], ctx->buf->data, rd);
+                // Результат определён: поток закрывается, остальные продолжают
+                if (more != 1) {
+                    res[j] = region_merge(res[j], plugins[p].psc(st[j]));
+                    st[j] = NULL;
+                    active--;
+                }
+                plugin_unlock(p);
+            }
+            throttle_cpu(ctx);
+            // Прочитанный блок сбрасывается сразу после передачи плагинам, вместе
+            // с предыдущим: большая страница на их границе освобождается сейчас
+            if (cur < rec)
+                io_drop(fd, ahead, cur > 0 ? cur - 1 : 0, cur + 1);
+            cur++;
+            off += rd;
+        }
+        // Страницы, подгруженные упреждающим чтением за последним прочитанным блоком
+        if (cur < rec)
+            io_drop(fd, ahead, cur > 0 ? cur - 1 : 0, rec);
+        if (rd == -1)
+            fprintf(stderr, "read() failed for %s: %s\n", ctx->path, strerror(errno));
+        for (size_t j = 0; j < cnt; j++) {
+            if (!st[j])
+                continue;
+            int p = expr_nodes[leaves[j]].plugin;
+            plugin_lock(p);
+            int tmp = plugins[p].psc(st[j]);
+            plugin_unlock(p);
+            res[j] = region_merge(res[j], rd == -1 ? -1 : tmp);
+        }
+    }
+    close(fd);
+
+    for (size_t j = 1; j < cnt; j++) {
+        if (res[j] == -1)
+            fprintf(stderr, "Error in plugin! %s", strerror(errno));
+        ctx->memo[leaves[j]] = res[j] == 0;
+    }
+    return res[0];
+}
+
+// Проверка плагином i прочитанного содержимого файла. Каждый участок
+// проверяется отдельно: совпадения через границу участков не ищутся.
+static int call_segs(int i, struct option *opts, size_t opts_len, eval_ctx *ctx) {
+    int tmp = 1;
+    for (size_t k = 0; k < ctx->segs_len && tmp != 0; k++) {
+        const file_seg *seg = &ctx->segs[k];
+        int res = -1;
+        if (plugins[i].pbf && !(plugins[i].psr && scan_align > 0)) {
+            res = plugins[i].pbf(ctx->data + seg->pos, seg->len, opts, opts_len);
+        } else {
+            void *st = region_open(i, opts, opts_len, seg->off);
+            if (st) {
+                plugins[i].psf(st, ctx->data + seg->pos, seg->len);
+                res = plugins[i].psc(st);
+            }
+        }
+        tmp = region_merge(tmp, res);
+    }
+    return tmp;
+}
+
+// Вызов плагина листа n. Плагину, принимающему данные, передаётся
+// содержимое файла (читается один раз на файл), остальным - путь к файлу.
+static int call_plugin(int n, eval_ctx *ctx) {
+    int i = expr_nodes[n].plugin;
+    struct option *opts = expr_nodes[n].opts;
+    size_t opts_len = expr_nodes[n].opts_len;
+    int wants_data = plugins[i].pbf || plugins[i].pso;
+    int loaded = wants_data && ctx_load(ctx) == 0;
+
+    // Большой файл читается один раз для всех потоковых листьев
+    if (!loaded && ctx->state == CTX_LARGE && plugins[i].pso)
+        return stream_leaves(n, ctx);
+
+    int tmp = 1;
+    plugin_lock(i);
+    if (loaded) {
+        // Файл укоротили, пока он был отображён (--io mmap): обращение к
+        // отображению дало SIGBUS, файл считается необработанным
+        sigjmp_buf jb;
+        if (ctx->map) {
+            if (sigsetjmp(jb, 1)) {
+                io_bus_jmp = NULL;
+                plugin_unlock(i);
+                fprintf(stderr, "File %s was truncated while mapped\n", ctx->path);
+                ctx->state = CTX_FAILED;
+                errno = EIO;
+                return -1;
+            }
+            io_bus_jmp = &jb;
+        }
+        tmp = call_segs(i, opts, opts_len, ctx);
+        io_bus_jmp = NULL;
+    } else {
+        // Плагин читает файл сам: учитывается весь файл
+        if (throttle && ctx->state == CTX_NONE) {
+            struct stat sb;
+            if (stat(ctx->path, &sb) == 0)
+                ctx->size = sb.st_size;
+        }
+        throttle_io(ctx->size, (ctx->size + STREAM_CHUNK - 1) / STREAM_CHUNK);
+        tmp = plugins[i].ppf(ctx->path, opts, opts_len);
+    }
+    plugin_unlock(i);
+    return tmp;
+}
+
+// Ленивое вычисление узла: AND/OR прекращают вычисление на первом определяющем
+// потомке, значения общих узлов запоминаются на время обработки файла
+static int expr_eval(int n, eval_ctx *ctx) {
+    if (ctx->memo[n] >= 0)
+        return ctx->memo[n];
+
+    expr_node *node = &expr_nodes[n];
+    int v = 0;
+    switch (node->op) {
+        case EXPR_LEAF: {
+            // Опции проверены до обхода (expr_check), здесь ошибка относится к файлу
+            int tmp = call_plugin(n, ctx);
+            // Обработка ошибок, если есть
+            if(tmp == -1)
+                fprintf(stderr, "Error in plugin! %s", strerror(errno));
+            v = tmp == 0;
+            break;
+        }
+        case EXPR_AND:
+            v = 1;
+            for (size_t k = 0; k < node->kids_len && v; k++)
+                v = expr_eval(node->kids[k], ctx);
+            break;
+        case EXPR_OR:
+            for (size_t k = 0; k < node->kids_len && !v; k++)
+                v = expr_eval(node->kids[k], ctx);
+            break;
+        case EXPR_NOT:
+            v = !expr_eval(node->kids[0], ctx);
+            break;
+    }
+    ctx->memo[n] = v;
+    return v;
+}
+
+// Вычисление результатов всех запросов для файла. Общие листья запросов
+// вычисляются один раз, файл читается не больше одного раза. Если содержимое
+// уже прочитано (data, len), файл не открывается для плагинов, принимающих данные.
+void eval_file(const char *path, int *verdicts, io_buf *buf, const unsigned char *data, ssize_t len) {
+    signed char memo[expr_len];
+    memset(memo, -1, expr_len);
+    eval_ctx ctx = { .path = path, .buf = buf, .memo = memo, .state = CTX_NONE };
+    if (data) {
+        ctx.state = CTX_LOADED;
+        ctx.data = data;
+        ctx.len = ctx.size = len;
+        ctx.segs[0] = (file_seg){ 0, len, 0 };
+        ctx.segs_len = 1;
+    }
+    if (throttle && throttle->cpu.rate > 0)
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ctx.cpu_mark);
+
+    for (size_t q = 0; q < expr_root_cnt; q++)
+        verdicts[q] = expr_eval(expr_roots[q], &ctx);
+    if (ctx.map)
+        munmap(ctx.map, ctx.len);
+
+    // Процессорное время обработки файла (поток или рабочий процесс) списывается
+    // из корзины; большие файлы учитываются ещё и по блокам в stream_leaves()
+    throttle_cpu(&ctx);
+}
+
+// Резервирование места в буфере вывода
+static void ob_reserve(out_buf *ob, size_t add) {
+    if (ob->len + add > ob->cap) {
+        ob->cap = MAX(ob->len + add, MAX(ob->cap * 2, 4096));
+        ob->data = realloc(ob->data, ob->cap);
+    }
+}
+
+static void ob_put(out_buf *ob, const void *data, size_t len) {
+    ob_reserve(ob, len);
+    memcpy(ob->data + ob->len, data, len);
+    ob->len += len;
+}
+
+// Длина корректной последовательности UTF-8 в начале s (0 - байт не начинает
+// корректный символ: лишний продолжающий байт, обрыв, избыточная форма, суррогат)
+static size_t utf8_len(const unsigned char *s) {
+    if (s[0] < 0x80)
+        return 1;
+    size_t n = s[0] >= 0xf0 && s[0] <= 0xf4 ? 4 : s[0] >= 0xe0 ? 3 : s[0] >= 0xc2 && s[0] <= 0xdf ? 2 : 0;
+    if (n == 0 || (n == 3 && s[0] > 0xef))
+        return 0;
+    for (size_t k = 1; k < n; k++)
+        if ((s[k] & 0xc0) != 0x80)
+            return 0;
+    if ((s[0] == 0xe0 && s[1] < 0xa0) || (s[0] == 0xed && s[1] >= 0xa0)
+            || (s[0] == 0xf0 && s[1] < 0x90) || (s[0] == 0xf4 && s[1] >= 0x90))
+        return 0;
+    return n;
+}
+
+// Строка JSON с экранированием кавычек, обратной косой черты и управляющих символов.
+// Байты, которые не образуют UTF-8, заменяются на U+FFFD; возвращается 0, если замены были.
+static int ob_put_json(out_buf *ob, const char *str) {
+    int exact = 1;
+    ob_put(ob, "\"", 1);
+    for (const unsigned char *c = (const unsigned char *)str; *c; ) {
+        char esc[8];
+        size_t n = utf8_len(c);
+        if (n == 0) {
+            ob_put(ob, "\\ufffd", 6);
+            exact = 0;
+            n = 1;
+        } else if (*c == '"' || *c == '\\') {
+            esc[0] = '\\';
+            esc[1] = *c;
+            ob_put(ob, esc, 2);
+        } else if (*c < 0x20) {
+            ob_put(ob, esc, sprintf(esc, "\\u%04x", *c));
+        } else {
+            ob_put(ob, c, n);
+        }
+        c += n;
+    }
+    ob_put(ob, "\"", 1);
+    return exact;
+}
+
+// Строка в base64 (в кавычках JSON)
+static void ob_put_base64(out_buf *ob, const unsigned char *data, size_t len) {
+    static const char abc[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    ob_put(ob, "\"", 1);
+    for (size_t i = 0; i < len; i += 3) {
+        unsigned v = data[i] << 16 | (i + 1 < len ? data[i + 1] << 8 : 0) | (i + 2 < len ? data[i + 2] : 0);
+        char q[4] = { abc[v >> 18], abc[(v >> 12) & 63],
+                      i + 1 < len ? abc[(v >> 6) & 63] : '=', i + 2 < len ? abc[v & 63] : '=' };
+        ob_put(ob, q, 4);
+    }
+    ob_put(ob, "\"", 1);
+}
+
+// Форматирование записи о найденном файле и запоминание её для контрольной точки
+// (в ck, если файл идёт через окно упорядочивания, иначе сразу в пакет точки)
+static void sink_record(out_buf *ob, out_buf *ck, const char *path, size_t query) {
+    const char *id = expr_ids[query];
+    size_t path_len = strlen(path);
+    switch (sink_format) {
+        case FMT_TEXT:
+            if (id) {
+                ob_put(ob, "[", 1);
+                ob_put(ob, id, strlen(id));
+                ob_put(ob, "] ", 2);
+            }
+            ob_put(ob, "Found file: ", 12);
+            ob_put(ob, path, path_len);
+            ob_put(ob, "\n", 1);
+            break;
+        case FMT_NUL:
+            if (id) {
+                ob_put(ob, id, strlen(id));
+                ob_put(ob, "\t", 1);
+            }
+            ob_put(ob, path, path_len + 1);
+            break;
+        case FMT_JSONL:
+            // Путь не в UTF-8 в JSON точно не передать: "path" получает замены,
+            // а точные байты идут в "path_base64"
+            ob_put(ob, "{\"path\":", 8);
+            if (!ob_put_json(ob, path)) {
+                ob_put(ob, ",\"path_base64\":", 15);
+                ob_put_base64(ob, (const unsigned char *)path, path_len);
+            }
+            if (id) {
+                ob_put(ob, ",\"query\":", 9);
+                ob_put_json(ob, id);
+            }
+            ob_put(ob, "}\n", 2);
+            break;
+        case FMT_BINARY: {
+            uint32_t len = path_len;
+            uint16_t hdr[2] = { (uint16_t)query, 0 };
+            ob_put(ob, &len, sizeof(len));
+            ob_put(ob, hdr, sizeof(hdr));
+            ob_put(ob, path, path_len);
+            break;
+        }
+    }
+
+    if (!ckpt_file)
+        return;
+    const char *rel = rel_path(path);
+    if (ck) {
+        ob_put(ck, "M ", 2);
+        if (id) {
+            ob_put(ck, id, strlen(id));
+            ob_put(ck, " ", 1);
+        }
+        ob_put(ck, rel, strlen(rel));
+        ob_put(ck, "\n", 1);
+        return;
+    }
+    pthread_mutex_lock(&out_mx);
+    size_t need = ckpt_buf_len + strlen(rel) + (id ? strlen(id) + 1 : 0) + 4;
+    if (need > ckpt_buf_cap) {
+        ckpt_buf_cap = MAX(need, ckpt_buf_cap * 2);
+        ckpt_buf = realloc(ckpt_buf, ckpt_buf_cap);
+    }
+    if (id)
+        ckpt_buf_len += sprintf(ckpt_buf + ckpt_buf_len, "M %s %s\n", id, rel);
+    else
+        ckpt_buf_len += sprintf(ckpt_buf + ckpt_buf_len, "M %s\n", rel);
+    pthread_mutex_unlock(&out_mx);
+}
+
+// Запись буфера в stdout
+static void sink_write(out_buf *ob) {
+    pthread_mutex_lock(&out_mx);
+    size_t off = 0;
+    while (off < ob->len) {
+        ssize_t n = write(STDOUT_FILENO, ob->data + off, ob->len - off);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1) {
+            fprintf(stderr, "write() failed: %s\n", strerror(errno));
+            break;
+        }
+        off += n;
+    }
+    pthread_mutex_unlock(&out_mx);
+    ob->len = 0;
+}
+
+// Сброс заполненного буфера (при контрольной точке - только вместе с ней)
+static void sink_commit(out_buf *ob) {
+    if (ob->len >= SINK_FLUSH && !ckpt_file)
+        sink_write(ob);
+}
+
+// Записи о файле для всех запросов, которым он удовлетворяет
+static void report_file(const char *path, const int *verdicts, out_buf *ob, out_buf *ck) {
+    for (size_t q = 0; q < expr_root_cnt; q++) {
+        if (verdicts[q]) {
+            // Печать пути найденного файла
+            sink_record(ob, ck, path, q);
+        }
+    }
+}
+
+// Файл rel (владение передаётся) завершён вместе со всеми предшественниками и
+// становится фронтом обхода; пакет записывается по числу файлов, объёму или времени
+static void ckpt_advance(char *rel) {
+    free(ckpt_frontier);
+    ckpt_frontier = rel;
+    ckpt_pending++;
+    if (ckpt_pending >= CKPT_EVERY_FILES || ckpt_buf_len >= CKPT_MAX_PENDING
+            || time(NULL) - ckpt_last >= CKPT_EVERY_SEC)
+        ckpt_flush();
+}
+
+// Вывод подряд готовых файлов из окна упорядочивания (только поток обхода).
+// С контрольной точкой их строки "M ..." переходят в пакет, а фронт сдвигается.
+static void order_drain(void) {
+    if (!order_win)
+        return;
+    for (;;) {
+        order_slot *slot = &order_win[order_next % order_win_len];
+        if (!atomic_load_explicit(&slot->ready, memory_order_acquire))
+            break;
+        ob_put(&sink_main, slot->ob.data, slot->ob.len);
+        slot->ob.len = 0;
+        if (ckpt_file) {
+            pthread_mutex_lock(&out_mx);
+            if (ckpt_buf_len + slot->ck.len > ckpt_buf_cap) {
+                ckpt_buf_cap = MAX(ckpt_buf_len + slot->ck.len, ckpt_buf_cap * 2);
+                ckpt_buf = realloc(ckpt_buf, ckpt_buf_cap);
+            }
+            if (slot->ck.len > 0)
+                memcpy(ckpt_buf + ckpt_buf_len, slot->ck.data, slot->ck.len);
+            ckpt_buf_len += slot->ck.len;
+            pthread_mutex_unlock(&out_mx);
+            slot->ck.len = 0;
+        }
+        atomic_store_explicit(&slot->ready, 0, memory_order_relaxed);
+        order_next++;
+        if (ckpt_file && slot->rel) {
+            char *rel = slot->rel;
+            slot->rel = NULL;
+            ckpt_advance(rel);
+        }
+    }
+    sink_commit(&sink_main);
+}
+
+// Ожидание места в окне для файла seq: окно не сдвигается, пока не готов самый старый файл
+static void order_reserve(unsigned long seq) {
+    order_drain();
+    while (seq - order_next >= order_win_len) {
+        if (iso_cnt > 0) {
+            iso_wait();
+        } else {
+            // Потоки пула сообщают о готовности файла через order_ready
+            order_slot *slot = &order_win[order_next % order_win_len];
+            pthread_mutex_lock(&out_mx);
+            while (!atomic_load_explicit(&slot->ready, memory_order_acquire))
+                pthread_cond_wait(&order_ready, &out_mx);
+            pthread_mutex_unlock(&out_mx);
+        }
+        order_drain();
+    }
+}
+
+// Записи о файле с номером seq, обработанном потоком или рабочим процессом
+static void report_file_async(const char *path, const int *verdicts, unsigned long seq, out_buf *own) {
+    if (!order_win) {
+        report_file(path, verdicts, own, NULL);
+        sink_commit(own);
+        return;
+    }
+    order_slot *slot = &order_win[seq % order_win_len];
+    report_file(path, verdicts, &slot->ob, ckpt_file ? &slot->ck : NULL);
+    atomic_store_explicit(&slot->ready, 1, memory_order_release);
+    // Сигнал под мьютексом, чтобы поток обхода не пропустил его между проверкой и ожиданием
+    if (pool_cnt > 0) {
+        pthread_mutex_lock(&out_mx);
+        pthread_cond_signal(&order_ready);
+        pthread_mutex_unlock(&out_mx);
+    }
+}
+
+// Настройка приёмника результатов
+int sink_start(const char *format) {
+    if (!format || !strcmp(format, "text"))
+        sink_format = FMT_TEXT;
+    else if (!strcmp(format, "nul"))
+        sink_format = FMT_NUL;
+    else if (!strcmp(format, "jsonl"))
+        sink_format = FMT_JSONL;
+    else if (!strcmp(format, "binary"))
+        sink_format = FMT_BINARY;
+    else {
+        fprintf(stderr, "Unknown --format '%s'\n", format);
+        return -1;
+    }
+
+    if (sink_format == FMT_BINARY) {
+        // Номер запроса в записи и длина идентификатора занимают по 16 бит
+        if (expr_root_cnt > UINT16_MAX) {
+            fprintf(stderr, "--format binary supports at most %u queries\n", UINT16_MAX);
+            return -1;
+        }
+        for (size_t q = 0; q < expr_root_cnt; q++) {
+            if (expr_ids[q] && strlen(expr_ids[q]) > UINT16_MAX) {
+                fprintf(stderr, "--format binary: query id longer than %u bytes\n", UINT16_MAX);
+                return -1;
+            }
+        }
+        uint32_t cnt = expr_root_cnt;
+        ob_put(&sink_main, SINK_MAGIC, 8);
+        ob_put(&sink_main, &cnt, sizeof(cnt));
+        for (size_t q = 0; q < expr_root_cnt; q++) {
+            const char *id = expr_ids[q] ? expr_ids[q] : "";
+            uint16_t len = strlen(id);
+            ob_put(&sink_main, &len, sizeof(len));
+            ob_put(&sink_main, id, len);
+        }
+    }
+
+    if (pool_cnt > 0) {
+        sink_bufs = calloc(pool_cnt, sizeof(out_buf));
+        sink_bufs_cnt = pool_cnt;
+    }
+
+    // Окно вмещает все файлы в обработке с запасом, чтобы медленный файл не останавливал обход сразу.
+    // Контрольной точке окно нужно для фронта, поэтому с ней вывод тоже упорядочен.
+    if ((sink_ordered || ckpt_file) && (pool_cnt > 0 || iso_cnt > 0)) {
+        order_win_len = 4 * (POOL_QUEUE + pool_cnt + iso_cnt * ISO_RING);
+        order_win = calloc(order_win_len, sizeof(order_slot));
+    }
+    return 0;
+}
+
+// Запись всех буферов (потоки пула должны простаивать)
+void sink_flush_all(void) {
+    order_drain();
+    if (sink_main.len > 0)
+        sink_write(&sink_main);
+    for (int i = 0; i < sink_bufs_cnt; i++)
+        if (sink_bufs[i].len > 0)
+            sink_write(&sink_bufs[i]);
+}
+
+// Освобождение буферов приёмника
+void sink_stop(void) {
+    sink_flush_all();
+    free(sink_main.data);
+    for (int i = 0; i < sink_bufs_cnt; i++)
+        free(sink_bufs[i].data);
+    for (size_t i = 0; i < order_win_len; i++) {
+        free(order_win[i].ob.data);
+        free(order_win[i].ck.data);
+        free(order_win[i].rel);
+    }
+    free(sink_bufs);
+    free(order_win);
+    sink_bufs = NULL;
+    sink_bufs_cnt = 0;
+    order_win = NULL;
+    order_win_len = 0;
+    memset(&sink_main, 0, sizeof(sink_main));
+}
+
+// Выделение памяти для графа; без памяти построить граф нельзя, поэтому работа завершается
+static void *expr_alloc(void *ptr, size_t size) {
+    void *res = realloc(ptr, size ? size : 1);
+    if (res == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(EXIT_FAILURE);
+    }
+    return res;
+}
+
+// Добавление узла; одинаковые узлы (тот же оператор и потомки, тот же плагин
+// и опции) не дублируются, поэтому общие подвыражения вычисляются один раз
+static int expr_add(expr_node node) {
+    for (size_t n = 0; n < expr_len; n++) {
+        expr_node *e = &expr_nodes[n];
+        if (e->op != node.op || e->plugin != node.plugin || e->kids_len != node.kids_len || e->opts_len != node.opts_len)
+            continue;
+        int same = 1;
+        for (size_t k = 0; k < node.kids_len && same; k++)
+            same = e->kids[k] == node.kids[k];
+        for (size_t k = 0; k < node.opts_len && same; k++)
+            same = !strcmp(e->opts[k].name, node.opts[k].name)
+                && ((!e->opts[k].flag && !node.opts[k].flag)
+                    || (e->opts[k].flag && node.opts[k].flag && !strcmp((char *)e->opts[k].flag, (char *)node.opts[k].flag)));
+        if (same) {
+            free(node.kids);
+            free(node.opts);
+            return n;
+        }
+    }
+
+    // Оценка стоимости: у листа - стоимость байта плагина, у узла - сумма потомков
+    if (node.op == EXPR_LEAF) {
+        double c = plugins[node.plugin].pi.cost_per_byte;
+        node.cost = c > 0 ? c : EXPR_UNKNOWN_COST;
+    } else {
+        node.cost = 0;
+        for (size_t k = 0; k < node.kids_len; k++)
+            node.cost += expr_nodes[node.kids[k]].cost;
+    }
+
+    expr_nodes = expr_alloc(expr_nodes, (expr_len + 1) * sizeof(expr_node));
+    expr_nodes[expr_len] = node;
+    return expr_len++;
+}
+
+// Лист: вызов плагина с набором опций
+static int expr_leaf(int plugin, struct option *opts, size_t opts_len) {
+    expr_node node = { .op = EXPR_LEAF, .plugin = plugin, .opts_len = opts_len };
+    node.opts = expr_alloc(NULL, opts_len * sizeof(struct option));
+    memcpy(node.opts, opts, opts_len * sizeof(struct option));
+    plugins[plugin].used = 1;
+    return expr_add(node);
+}
+
+static int expr_cost_cmp(const void *a, const void *b) {
+    double ca = expr_nodes[*(const int *)a].cost, cb = expr_nodes[*(const int *)b].cost;
+    return (ca > cb) - (ca < cb);
+}
+
+// Опция, которой заданы все шаблоны листа (NULL - лист не из одной опции).
+// Сливать под OR можно только такие листья: повтор одной опции у плагина с
+// PLUGIN_CAP_MULTI означает "любой из шаблонов", а разные опции - их сочетание.
+static const char *expr_leaf_opt(const expr_node *node) {
+    if (node->op != EXPR_LEAF || node->opts_len == 0 || !(plugins[node->plugin].pi.caps & PLUGIN_CAP_MULTI))
+        return NULL;
+    for (size_t k = 1; k < node->opts_len; k++)
+        if (strcmp(node->opts[k].name, node->opts[0].name) != 0)
+            return NULL;
+    return node->opts[0].name;
+}
+
+// Узел AND/OR: вложенные узлы того же оператора раскрываются, листья одной
+// опции плагина с PLUGIN_CAP_MULTI под OR сливаются в один вызов, потомки
+// упорядочиваются по стоимости, чтобы дешёвые проверки отсекали дорогие
+static int expr_join(int op, const int *kids, size_t kids_len) {
+    int *flat = NULL;
+    size_t flat_len = 0;
+    for (size_t k = 0; k < kids_len; k++) {
+        const expr_node *kid = &expr_nodes[kids[k]];
+        size_t add = kid->op == op ? kid->kids_len : 1;
+        flat = expr_alloc(flat, (flat_len + add) * sizeof(int));
+        if (kid->op == op)
+            memcpy(flat + flat_len, kid->kids, add * sizeof(int));
+        else
+            flat[flat_len] = kids[k];
+        flat_len += add;
+    }
+
+    if (op == EXPR_OR) {
+        for (size_t a = 0; a < flat_len; a++) {
+            expr_node *la = &expr_nodes[flat[a]];
+            const char *name = expr_leaf_opt(la);
+            if (!name)
+                continue;
+            struct option *opts = expr_alloc(NULL, la->opts_len * sizeof(struct option));
+            memcpy(opts, la->opts, la->opts_len * sizeof(struct option));
+            size_t opts_len = la->opts_len;
+            int plugin = la->plugin, merged = 0;
+            for (size_t b = a + 1; b < flat_len; b++) {
+                expr_node *lb = &expr_nodes[flat[b]];
+                const char *lb_name = expr_leaf_opt(lb);
+                if (lb->plugin != plugin || !lb_name || strcmp(lb_name, name) != 0)
+                    continue;
+                opts = expr_alloc(opts, (opts_len + lb->opts_len) * sizeof(struct option));
+                memcpy(opts + opts_len, lb->opts, lb->opts_len * sizeof(struct option));
+                opts_len += lb->opts_len;
+                flat[b--] = flat[--flat_len];
+                merged = 1;
+            }
+            if (merged)
+                flat[a] = expr_leaf(plugin, opts, opts_len);
+            free(opts);
+        }
+    }
+
+    if (flat_len == 1) {
+        int only = flat[0];
+        free(flat);
+        return only;
+    }
+    qsort(flat, flat_len, sizeof(int), expr_cost_cmp);
+    expr_node node = { .op = op, .plugin = -1, .kids = flat, .kids_len = flat_len };
+    return expr_add(node);
+}
+
+static int expr_not(int kid) {
+    // NOT NOT x = x
+    if (expr_nodes[kid].op == EXPR_NOT)
+        return expr_nodes[kid].kids[0];
+    expr_node node = { .op = EXPR_NOT, .plugin = -1, .kids_len = 1 };
+    node.kids = expr_alloc(NULL, sizeof(int));
+    node.kids[0] = kid;
+    return expr_add(node);
+}
+
+// Разбор выражения: лексема - скобка, AND/OR/NOT или лист "опция[=значение]"
+static const char *expr_src;    // Текущая позиция разбора
+static char expr_tok[PATH_MAX]; // Текущая лексема
+
+static void expr_next(void) {
+    while (*expr_src == ' ' || *expr_src == '\t')
+        expr_src++;
+    size_t len = 0;
+    if (*expr_src == '(' || *expr_src == ')') {
+        expr_tok[len++] = *expr_src++;
+    } else {
+        while (*expr_src && !strchr(" \t()", *expr_src) && len < sizeof(expr_tok) - 1)
+            expr_tok[len++] = *expr_src++;
+    }
+    expr_tok[len] = '\0';
+}
+
+static int expr_parse_or(void);
+
+static int expr_parse_factor(void) {
+    if (!strcasecmp(expr_tok, "NOT")) {
+        expr_next();
+        int kid = expr_parse_factor();
+        return kid < 0 ? kid : expr_not(kid);
+    }
+    if (!strcmp(expr_tok, "(")) {
+        expr_next();
+        int n = expr_parse_or();
+        if (n < 0)
+            return n;
+        if (strcmp(expr_tok, ")")) {
+            fprintf(stderr, "Expression: expected ')' instead of '%s'\n", expr_tok);
+            return -1;
+        }
+        expr_next();
+        return n;
+    }
+    if (!*expr_tok || !strcmp(expr_tok, ")") || !strcasecmp(expr_tok, "AND") || !strcasecmp(expr_tok, "OR")) {
+        fprintf(stderr, "Expression: expected plugin option instead of '%s'\n", *expr_tok ? expr_tok : "end");
+        return -1;
+    }
+
+    // Лист: поиск опции среди опций плагинов
+    char *name = expr_tok;
+    while (*name == '-')
+        name++;
+    char *value = strchr(name, '=');
+    if (value)
+        *value++ = '\0';
+    for (int i = 0; i < plug_cnt; i++) {
+        for (size_t j = 0; j < plugins[i].pi.sup_opts_len; j++) {
+            struct option opt = plugins[i].pi.sup_opts[j].opt;
+            if (strcmp(opt.name, name) != 0)
+                continue;
+            if (opt.has_arg == required_argument && !value) {
+                fprintf(stderr, "Expression: option '%s' requires a value\n", name);
+                return -1;
+            }
+            // Значение хранится до конца работы, как optarg у обычных опций
+            opt.flag = value ? (int *)strdup(value) : NULL;
+            got_opts++;
+            expr_next();
+            return expr_leaf(i, &opt, 1);
+        }
+    }
+    fprintf(stderr, "Expression: unknown plugin option '%s'\n", name);
+    return -1;
+}
+
+static int expr_parse_and(void) {
+    int kids[2];
+    kids[0] = expr_parse_factor();
+    while (kids[0] >= 0 && !strcasecmp(expr_tok, "AND")) {
+        expr_next();
+        kids[1] = expr_parse_factor();
+        if (kids[1] < 0)
+            return -1;
+        kids[0] = expr_join(EXPR_AND, kids, 2);
+    }
+    return kids[0];
+}
+
+static int expr_parse_or(void) {
+    int kids[2];
+    kids[0] = expr_parse_and();
+    while (kids[0] >= 0 && !strcasecmp(expr_tok, "OR")) {
+        expr_next();
+        kids[1] = expr_parse_and();
+        if (kids[1] < 0)
+            return -1;
+        kids[0] = expr_join(EXPR_OR, kids, 2);
+    }
+    return kids[0];
+}
+
+// Компиляция выражения --expr в граф решений
+int expr_compile(const char *src) {
+    expr_src = src;
+    expr_next();
+    int root = expr_parse_or();
+    if (root >= 0 && *expr_tok) {
+        fprintf(stderr, "Expression: unexpected '%s'\n", expr_tok);
+        return -1;
+    }
+    return root;
+}
+
+// Сколько раз опция с именем name встречается среди n опций
+static size_t opt_count(const struct option *opts, size_t n, const char *name) {
+    size_t cnt = 0;
+    for (size_t k = 0; k < n; k++)
+        cnt += !strcmp(opts[k].name, name);
+    return cnt;
+}
+
+// Сборка графа из опций плагинов (opts[i] - опции i-го плагина): один лист на
+// плагин с его опциями, листья объединяются по -A/-O, -N добавляет отрицание.
+// Плагин с PLUGIN_CAP_MULTI считает повторы одной опции шаблонами "любой из",
+// поэтому с -A каждый повтор становится отдельным листом со всеми
+// неповторёнными опциями плагина, и листья объединяются по AND.
+static int expr_compile_opts(struct option **opts, const size_t *opts_len, int use_or, int use_not) {
+    int *leaves = NULL;
+    size_t leaves_len = 0;
+    for (int i = 0; i < plug_cnt; i++) {
+        if (opts_len[i] == 0)
+            continue;
+        size_t n = opts_len[i], base_len = 0, reps = 0;
+        if (!use_or && (plugins[i].pi.caps & PLUGIN_CAP_MULTI)) {
+            for (size_t k = 0; k < n; k++)
+                reps += opt_count(opts[i], n, opts[i][k].name) > 1;
+        }
+        if (reps == 0) {
+            leaves = expr_alloc(leaves, (leaves_len + 1) * sizeof(int));
+            leaves[leaves_len++] = expr_leaf(i, opts[i], n);
+            continue;
+        }
+
+        // Неповторённые опции идут в каждый лист, последнее место - под один повтор
+        struct option leaf_opts[n];
+        for (size_t k = 0; k < n; k++)
+            if (opt_count(opts[i], n, opts[i][k].name) == 1)
+                leaf_opts[base_len++] = opts[i][k];
+        leaves = expr_alloc(leaves, (leaves_len + reps) * sizeof(int));
+        for (size_t k = 0; k < n; k++) {
+            if (opt_count(opts[i], n, opts[i][k].name) == 1)
+                continue;
+            leaf_opts[base_len] = opts[i][k];
+            leaves[leaves_len++] = expr_leaf(i, leaf_opts, base_len + 1);
+        }
+    }
+    if (leaves_len == 0)
+        return -1;
+
+    int root = expr_join(use_or ? EXPR_OR : EXPR_AND, leaves, leaves_len);
+    free(leaves);
+    return use_not ? expr_not(root) : root;
+}
+
+// Сборка графа из опций командной строки
+int expr_compile_legacy(void) {
+    struct option *opts[plug_cnt];
+    size_t opts_len[plug_cnt];
+    for (int i = 0; i < plug_cnt; i++) {
+        opts[i] = plugins[i].in_opts;
+        opts_len[i] = plugins[i].in_opts_len;
+    }
+    return expr_compile_opts(opts, opts_len, or, not);
+}
+
+// Добавление запроса с корнем root (ошибка компиляции передаётся дальше)
+int expr_add_root(int root, const char *id) {
+    if (root < 0)
+        return -1;
+    expr_roots = expr_alloc(expr_roots, (expr_root_cnt + 1) * sizeof(int));
+    expr_ids = expr_alloc(expr_ids, (expr_root_cnt + 1) * sizeof(char *));
+    expr_roots[expr_root_cnt] = root;
+    expr_ids[expr_root_cnt] = id ? strdup(id) : NULL;
+    expr_root_cnt++;
+    return 0;
+}
+
+// Разбор опций запроса в стиле командной строки: -A, -O, -N и опции плагинов
+// ("--opt значение" или "--opt=значение")
+static int query_compile_opts(char *args) {
+    struct option *opts[plug_cnt];
+    size_t opts_len[plug_cnt];
+    int use_or = 0, use_not = 0, root = -1;
+    for (int i = 0; i < plug_cnt; i++) {
+        opts[i] = NULL;
+        opts_len[i] = 0;
+    }
+
+    char *save = NULL;
+    for (char *tok = strtok_r(args, " \t", &save); tok; tok = strtok_r(NULL, " \t", &save)) {
+        if (!strcmp(tok, "-A")) {
+            use_or = 0;
+            continue;
+        }
+        if (!strcmp(tok, "-O")) {
+            use_or = 1;
+            continue;
+        }
+        if (!strcmp(tok, "-N")) {
+            use_not = 1;
+            continue;
+        }
+        if (strncmp(tok, "--", 2) != 0) {
+            fprintf(stderr, "Query: unexpected '%s'\n", tok);
+            goto out;
+        }
+
+        char *name = tok + 2;
+        char *value = strchr(name, '=');
+        if (value)
+            *value++ = '\0';
+        int found = 0;
+        for (int i = 0; i < plug_cnt && !found; i++) {
+            for (size_t j = 0; j < plugins[i].pi.sup_opts_len && !found; j++) {
+                struct option opt = plugins[i].pi.sup_opts[j].opt;
+                if (strcmp(opt.name, name) != 0)
+                    continue;
+                found = 1;
+                if (opt.has_arg == required_argument && !value)
+                    value = strtok_r(NULL, " \t", &save);
+                if (opt.has_arg == required_argument && !value) {
+                    fprintf(stderr, "Query: option '%s' requires a value\n", name);
+                    goto out;
+                }
+                // Значение хранится до конца работы, как optarg у обычных опций
+                opt.flag = value ? (int *)strdup(value) : NULL;
+                opts[i] = expr_alloc(opts[i], (opts_len[i] + 1) * sizeof(struct option));
+                opts[i][opts_len[i]++] = opt;
+                got_opts++;
+            }
+        }
+        if (!found) {
+            fprintf(stderr, "Query: unknown plugin option '%s'\n", name);
+            goto out;
+        }
+    }
+    root = expr_compile_opts(opts, opts_len, use_or, use_not);
+    if (root < 0)
+        fprintf(stderr, "Query: no plugin options\n");
+
+out:
+    for (int i = 0; i < plug_cnt; i++)
+        free(opts[i]);
+    return root;
+}
+
+// Загрузка файла запросов. Строка: "<id> <опции>" или "<id> --expr <выражение>",
+// пустые строки и строки с # пропускаются. Все запросы компилируются в один граф,
+// поэтому одинаковые листья разных запросов вычисляются один раз на файл.
+int queries_load(const char *fname) {
+    FILE *f = fopen(fname, "r");
+    if (!f) {
+        fprintf(stderr, "Cannot open queries file %s: %s\n", fname, strerror(errno));
+        return -1;
+    }
+
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    int lineno = 0, res = 0;
+    while (res == 0 && (len = getline(&line, &cap, f)) > 0) {
+        lineno++;
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+            line[--len] = '\0';
+        char *id = line + strspn(line, " \t");
+        if (*id == '\0' || *id == '#')
+            continue;
+
+        char *args = id + strcspn(id, " \t");
+        if (*args)
+            *args++ = '\0';
+        args += strspn(args, " \t");
+
+        // Идентификатор отличает результаты запросов в выводе, поэтому повторяться не может
+        int dup = 0;
+        for (size_t q = 0; q < expr_root_cnt && !dup; q++)
+            dup = !strcmp(expr_ids[q], id);
+        if (dup) {
+            fprintf(stderr, "%s:%d: duplicate query id '%s'\n", fname, lineno, id);
+            res = -1;
+            continue;
+        }
+
+        int root;
+        if (!strncmp(args, "--expr", 6) && (args[6] == ' ' || args[6] == '\t' || args[6] == '='))
+            root = expr_compile(args + 7);
+        else
+            root = query_compile_opts(args);
+        if (root < 0 || expr_add_root(root, id) < 0) {
+            fprintf(stderr, "%s:%d: invalid query '%s'\n", fname, lineno, id);
+            res = -1;
+        }
+    }
+    free(line);
+    fclose(f);
+
+    if (res == 0 && expr_root_cnt == 0) {
+        fprintf(stderr, "No queries in %s\n", fname);
+        res = -1;
+    }
+    return res;
+}
+
+// Проверка опций всех листьев до обхода: пробный вызов плагина без данных.
+// Ошибка EINVAL/ERANGE означает неверные опции, и обход не начинается - иначе
+// лист давал бы ложь для каждого файла, что под NOT выглядело бы совпадением.
+int expr_check(void) {
+    for (size_t n = 0; n < expr_len; n++) {
+        expr_node *node = &expr_nodes[n];
+        if (node->op != EXPR_LEAF)
+            continue;
+        dynamic_lib *p = &plugins[node->plugin];
+        int tmp;
+        errno = 0;
+        if (p->pso) {
+            // С --align плагин может разбирать опции иначе (шаблоны из целых байт)
+            void *st = p->psr && scan_align > 0 ? p->psr(node->opts, node->opts_len, 0, scan_align)
+                                                : p->pso(node->opts, node->opts_len);
+            tmp = st ? 0 : -1;
+            if (st)
+                p->psc(st);
+        } else if (p->pbf) {
+            tmp = p->pbf((const unsigned char *)"", 0, node->opts, node->opts_len);
+        } else {
+            tmp = p->ppf("/dev/null", node->opts, node->opts_len);
+        }
+        if (tmp == -1 && (errno == EINVAL || errno == ERANGE)) {
+            fprintf(stderr, "Invalid options for plugin %s (--%s): %s\n",
+                    p->path, node->opts[0].name, strerror(errno));
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Освобождение графа
+void expr_free(void) {
+    for (size_t n = 0; n < expr_len; n++) {
+        free(expr_nodes[n].kids);
+        free(expr_nodes[n].opts);
+    }
+    free(expr_nodes);
+    for (size_t q = 0; q < expr_root_cnt; q++)
+        free(expr_ids[q]);
+    free(expr_ids);
+    free(expr_roots);
+    expr_nodes = NULL;
+    expr_ids = NULL;
+    expr_roots = NULL;
+    expr_len = 0;
+    expr_root_cnt = 0;
+}
+
+// Функция для печати информации о найденных файлах
+void print_entry(int type, const char *path) {
+    // Пропуск записей каталога и нерегулярных файлов
+    if (!strcmp(path, ".") || !strcmp(path, "..") || type != FTW_F)
+        return;
+
+    // В изолированном режиме файл уходит рабочему процессу, результат придёт позже
+    if (iso_cnt > 0 || pool_cnt > 0) {
+        unsigned long seq = order_seq++;
+        if (order_win) {
+            order_reserve(seq);
+            // Фронт сдвинется на этот файл, когда завершатся он и все предыдущие
+            if (ckpt_file)
+                order_win[seq % order_win_len].rel = strdup(rel_path(path));
+        }
+        if (iso_cnt > 0)
+            iso_submit(path, seq);
+        else
+            pool_submit(path, seq);
+        return;
+    }
+
+    static io_buf buf;
+    int verdicts[expr_root_cnt];
+    eval_file(path, verdicts, &buf, NULL, -1);
+    report_file(path, verdicts, &sink_main, NULL);
+    sink_commit(&sink_main);
+}
+
+// Поток пула: обработка путей из очереди
+static void *pool_thread(void *arg) {
+    out_buf *own = &sink_bufs[(intptr_t)arg];
+    io_buf buf = {0};
+    int verdicts[expr_root_cnt];
+
+    for (;;) {
+        pthread_mutex_lock(&pool_mx);
+        while (pool_len == 0 && !pool_stopping)
+            pthread_cond_wait(&pool_nonempty, &pool_mx);
+        if (pool_len == 0) {
+            pthread_mutex_unlock(&pool_mx);
+            break;
+        }
+        char *path = pool_queue[pool_head].path;
+        unsigned long seq = pool_queue[pool_head].seq;
+        pool_head = (pool_head + 1) % POOL_QUEUE;
+        pool_len--;
+        pool_busy++;
+        pthread_cond_signal(&pool_nonfull);
+        pthread_mutex_unlock(&pool_mx);
+
+        eval_file(path, verdicts, &buf, NULL, -1);
+        report_file_async(path, verdicts, seq, own);
+        free(path);
+
+        pthread_mutex_lock(&pool_mx);
+        pool_busy--;
+        if (pool_len == 0 && pool_busy == 0)
+            pthread_cond_broadcast(&pool_idle);
+        pthread_mutex_unlock(&pool_mx);
+    }
+
+    free(buf.data);
+    return NULL;
+}
+
+// Запуск пула из cnt потоков
+int pool_start(int cnt) {
+    for (int i = 0; i < plug_cnt; i++)
+        pthread_mutex_init(&plugins[i].lock, NULL);
+
+    pool_threads = calloc(cnt, sizeof(pthread_t));
+    for (int i = 0; i < cnt; i++) {
+        int err = pthread_create(&pool_threads[i], NULL, pool_thread, (void *)(intptr_t)i);
+        if (err != 0) {
+            fprintf(stderr, "pthread_create() failed: %s\n", strerror(err));
+            pool_cnt = i;
+            pool_stop();
+            return -1;
+        }
+    }
+    pool_cnt = cnt;
+
+    if (getenv("LAB1DEBUG") != NULL) {
+        for (int i = 0; i < plug_cnt; i++)
+            if (plugins[i].used && !(plugins[i].pi.caps & PLUGIN_CAP_REENTRANT))
+                fprintf(stderr, "Plugin '%s' is not reentrant, its calls are serialized\n", plugins[i].pi.plugin_purpose);
+    }
+    return 0;
+}
+
+// Постановка пути в очередь пула
+void pool_submit(const char *path, unsigned long seq) {
+    pthread_mutex_lock(&pool_mx);
+    while (pool_len == POOL_QUEUE)
+        pthread_cond_wait(&pool_nonfull, &pool_mx);
+    pool_queue[(pool_head + pool_len) % POOL_QUEUE].path = strdup(path);
+    pool_queue[(pool_head + pool_len) % POOL_QUEUE].seq = seq;
+    pool_len++;
+    pthread_cond_signal(&pool_nonempty);
+    pthread_mutex_unlock(&pool_mx);
+}
+
+// Ожидание обработки всех поставленных в очередь файлов
+void pool_drain(void) {
+    if (pool_cnt == 0)
+        return;
+    pthread_mutex_lock(&pool_mx);
+    while (pool_len > 0 || pool_busy > 0)
+        pthread_cond_wait(&pool_idle, &pool_mx);
+    pthread_mutex_unlock(&pool_mx);
+}
+
+// Остановка пула потоков после обработки очереди
+void pool_stop(void) {
+    if (!pool_threads)
+        return;
+    pthread_mutex_lock(&pool_mx);
+    pool_stopping = 1;
+    pthread_cond_broadcast(&pool_nonempty);
+    pthread_mutex_unlock(&pool_mx);
+
+    for (int i = 0; i < pool_cnt; i++)
+        pthread_join(pool_threads[i], NULL);
+    for (int i = 0; i < plug_cnt; i++)
+        pthread_mutex_destroy(&plugins[i].lock);
+    free(pool_threads);
+    pool_threads = NULL;
+    pool_cnt = 0;
+}
+
+// Слот кольца рабочего процесса по порядковому номеру файла
+static struct iso_slot *iso_slot_at(iso_worker *w, unsigned long seq) {
+    return (struct iso_slot *)(w->ring + (seq % ISO_RING) * iso_slot_size);
+}
+
+// Содержимое файла в слоте
+static unsigned char *iso_slot_data(struct iso_slot *slot) {
+    return (unsigned char *)slot + iso_data_off;
+}
+
+// Чтение файла в слот хостом. Возвращает длину или -1, если файл должен
+// прочитать рабочий процесс (не помещается или не открывается).
+static ssize_t iso_read(const char *path, unsigned char *data) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return -1;
+    struct stat sb;
+    ssize_t total = -1;
+    if (fstat(fd, &sb) == 0 && S_ISREG(sb.st_mode) && sb.st_size <= ISO_DATA_MAX) {
+        int direct = 0;
+        ssize_t n = 0;
+        total = 0;
+        while (total < sb.st_size && (n = io_pread(fd, data + total, sb.st_size - total, total, &direct)) > 0)
+            total += n;
+        if (n == -1)
+            total = -1;
+    }
+    close(fd);
+    return total;
+}
+
+// Время от начала обработки первого незавершённого файла процесса, в секундах
+static double iso_elapsed(const iso_worker *w) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - w->head_start.tv_sec) + (now.tv_nsec - w->head_start.tv_nsec) / 1e9;
+}
+
+// Главный цикл рабочего процесса: обработка слотов по порядку, начиная с first_seq
+static void iso_worker_loop(iso_worker *w, unsigned long first_seq) {
+    unsigned long seq = first_seq;
+    io_buf buf = {0};
+    for (;;) {
+        uint64_t n;
+        if (read(w->req_fd, &n, sizeof(n)) != sizeof(n)) {
+            if (errno == EINTR)
+                continue;
+            _exit(EXIT_FAILURE);
+        }
+        while (n-- > 0) {
+            struct iso_slot *slot = iso_slot_at(w, seq);
+            if (slot->data_len >= 0)
+                eval_file(slot->path, slot->res, &buf, iso_slot_data(slot), slot->data_len);
+            else
+                eval_file(slot->path, slot->res, &buf, NULL, -1);
+            seq++;
+            uint64_t one = 1;
+            if (write(w->resp_fd, &one, sizeof(one)) != sizeof(one))
+                _exit(EXIT_FAILURE);
+        }
+    }
+}
+
+// Запуск (или перезапуск) рабочего процесса. Необработанные слоты кольца сохраняются,
+// новый процесс продолжает с первого незавершённого.
+static int iso_spawn(iso_worker *w) {
+    int death[2];
+    w->req_fd = eventfd(0, EFD_CLOEXEC);
+    w->resp_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (w->req_fd == -1 || w->resp_fd == -1 || pipe2(death, O_CLOEXEC) == -1) {
+        fprintf(stderr, "Cannot create worker channels: %s\n", strerror(errno));
+        return -1;
+    }
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == -1) {
+        fprintf(stderr, "fork() failed: %s\n", strerror(errno));
+        close(death[0]);
+        close(death[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        // Процесс не должен пережить хост
+        prctl(PR_SET_PDEATHSIG, SIGKILL);
+        close(death[0]);
+        iso_worker_loop(w, w->completed);
+    }
+
+    close(death[1]);
+    w->pid = pid;
+    w->death_fd = death[0];
+    w->timed_out = 0;
+    clock_gettime(CLOCK_MONOTONIC, &w->head_start);
+
+    // Досылка файлов, оставшихся в кольце от предыдущего процесса
+    uint64_t left = w->submitted - w->completed;
+    if (left > 0 && write(w->req_fd, &left, sizeof(left)) != sizeof(left))
+        return -1;
+    return 0;
+}
+
+// Закрытие каналов рабочего процесса
+static void iso_close_fds(iso_worker *w) {
+    close(w->req_fd);
+    close(w->resp_fd);
+    close(w->death_fd);
+}
+
+// Запуск пула из cnt рабочих процессов
+int iso_start(int cnt) {
+    iso_slot_size = (sizeof(struct iso_slot) + expr_root_cnt * sizeof(int) + 7) & ~(size_t)7;
+
+    // Содержимое передаётся, только если его примет хотя бы один плагин.
+    // С --range рабочий процесс читает нужные участки сам.
+    int wants_data = 0;
+    for (int i = 0; i < plug_cnt; i++)
+        if (plugins[i].used && (plugins[i].pbf || plugins[i].pso))
+            wants_data = 1;
+    if (wants_data && ranges_len == 0) {
+        iso_data_off = iso_slot_size;
+        iso_slot_size += ISO_DATA_MAX;
+    }
+
+    iso = calloc(cnt, sizeof(iso_worker));
+    for (int i = 0; i < cnt; i++) {
+        iso[i].ring = mmap(NULL, ISO_RING * iso_slot_size, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (iso[i].ring == MAP_FAILED) {
+            fprintf(stderr, "mmap() failed: %s\n", strerror(errno));
+            iso_cnt = i;
+            iso_stop();
+            return -1;
+        }
+        if (iso_spawn(&iso[i]) == -1) {
+            munmap(iso[i].ring, ISO_RING * iso_slot_size);
+            iso_cnt = i;
+            iso_stop();
+            return -1;
+        }
+    }
+    iso_cnt = cnt;
+    return 0;
+}
+
+// Разбор завершённых слотов рабочего процесса
+static void iso_collect(iso_worker *w) {
+    uint64_t n;
+    if (read(w->resp_fd, &n, sizeof(n)) != sizeof(n))
+        return;
+    while (n-- > 0 && w->completed < w->submitted) {
+        struct iso_slot *slot = iso_slot_at(w, w->completed);
+        report_file_async(slot->path, slot->res, slot->seq, &sink_main);
+        w->completed++;
+        clock_gettime(CLOCK_MONOTONIC, &w->head_start);
+    }
+    order_drain();
+}
+
+// Обработка падения рабочего процесса: файл, на котором он упал,
+// помечается как неудачный, процесс перезапускается
+static void iso_restart(iso_worker *w) {
+    int status;
+    iso_collect(w);
+    waitpid(w->pid, &status, 0);
+    iso_close_fds(w);
+
+    if (w->completed < w->submitted) {
+        struct iso_slot *slot = iso_slot_at(w, w->completed);
+        if (w->timed_out)
+            fprintf(stderr, "Plugin worker timed out on %s after %ld s, file marked as failed\n",
+                    slot->path, iso_timeout);
+        else if (WIFSIGNALED(status))
+            fprintf(stderr, "Plugin worker crashed on %s (%s), file marked as failed\n",
+                    slot->path, strsignal(WTERMSIG(status)));
+        else
+            fprintf(stderr, "Plugin worker exited on %s, file marked as failed\n", slot->path);
+        // Неудачный файл не даёт записей, но должен освободить место в окне
+        if (order_win) {
+            int none[expr_root_cnt];
+            memset(none, 0, sizeof(none));
+            report_file_async(slot->path, none, slot->seq, &sink_main);
+        }
+        w->completed++;
+    }
+
+    if (iso_spawn(w) == -1) {
+        fprintf(stderr, "Cannot restart plugin worker\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Ожидание завершения хотя бы одного файла в любом из рабочих процессов.
+// Процесс, который дольше iso_timeout обрабатывает один файл, убивается;
+// перезапуск происходит как после падения.
+void iso_wait(void) {
+    struct pollfd pfd[2 * iso_cnt];
+    int wait_ms = -1;
+    for (int i = 0; i < iso_cnt; i++) {
+        pfd[2 * i] = (struct pollfd){ .fd = iso[i].resp_fd, .events = POLLIN };
+        pfd[2 * i + 1] = (struct pollfd){ .fd = iso[i].death_fd, .events = POLLIN };
+        if (iso_timeout > 0 && iso[i].submitted != iso[i].completed && !iso[i].timed_out) {
+            double left = iso_timeout - iso_elapsed(&iso[i]);
+            int ms = left > 0 ? (int)(left * 1000) + 1 : 0;
+            if (wait_ms == -1 || ms < wait_ms)
+                wait_ms = ms;
+        }
+    }
+    int ready = poll(pfd, 2 * iso_cnt, wait_ms);
+    if (ready == -1) {
+        if (errno != EINTR)
+            fprintf(stderr, "poll() failed: %s\n", strerror(errno));
+        return;
+    }
+    if (ready == 0) {
+        for (int i = 0; i < iso_cnt; i++) {
+            iso_worker *w = &iso[i];
+            if (w->submitted == w->completed || w->timed_out)
+                continue;
+            // Сначала учитываются уже готовые файлы, чтобы не убить процесс, который успел
+            iso_collect(w);
+            if (w->submitted != w->completed && iso_elapsed(w) >= iso_timeout) {
+                w->timed_out = 1;
+                kill(w->pid, SIGKILL);
+            }
+        }
+        return;
+    }
+
+    for (int i = 0; i < iso_cnt; i++) {
+        if (pfd[2 * i].revents & POLLIN)
+            iso_collect(&iso[i]);
+        if (pfd[2 * i + 1].revents)
+            iso_restart(&iso[i]);
+    }
+}
+
+// Отправка файла наименее загруженному рабочему процессу
+void iso_submit(const char *path, unsigned long seq) {
+    for (;;) {
+        iso_worker *best = NULL;
+        for (int i = 0; i < iso_cnt; i++) {
+            unsigned long busy = iso[i].submitted - iso[i].completed;
+            if (busy < ISO_RING && (!best || busy < best->submitted - best->completed))
+                best = &iso[i];
+        }
+        if (!best) {
+            // Все кольца заполнены
+            iso_wait();
+            continue;
+        }
+
+        struct iso_slot *slot = iso_slot_at(best, best->submitted);
+        strncpy(slot->path, path, PATH_MAX - 1);
+        slot->path[PATH_MAX - 1] = '\0';
+        slot->seq = seq;
+        slot->data_len = iso_data_off ? iso_read(path, iso_slot_data(slot)) : -1;
+        // Простаивавший процесс начинает этот файл сейчас
+        if (best->submitted == best->completed)
+            clock_gettime(CLOCK_MONOTONIC, &best->head_start);
+        best->submitted++;
+
+        uint64_t one = 1;
+        if (write(best->req_fd, &one, sizeof(one)) != sizeof(one))
+            fprintf(stderr, "Cannot signal plugin worker: %s\n", strerror(errno));
+        return;
+    }
+}
+
+// Ожидание завершения всех отправленных файлов
+void iso_drain(void) {
+    for (;;) {
+        int busy = 0;
+        for (int i = 0; i < iso_cnt; i++)
+            if (iso[i].submitted != iso[i].completed)
+                busy = 1;
+        if (!busy)
+            return;
+        iso_wait();
+    }
+}
+
+// Остановка пула рабочих процессов
+void iso_stop(void) {
+    for (int i = 0; i < iso_cnt; i++) {
+        kill(iso[i].pid, SIGKILL);
+        waitpid(iso[i].pid, NULL, 0);
+        iso_close_fds(&iso[i]);
+        munmap(iso[i].ring, ISO_RING * iso_slot_size);
+    }
+    free(iso);
+    iso = NULL;
+    iso_cnt = 0;
+}
+
+// Функция обхода каталогов
+int walk_func(const char *fpath, const struct stat *sb, int typeflag) {
+    if(!sb) return -1;
+    // Файлы чужого шарда отбрасываются до вызова плагинов
+    if (typeflag == FTW_F && !in_shard(fpath))
+        return 0;
+    print_entry( typeflag, fpath); 
+   
+    return 0;
+}
+
+// Сравнение относительных путей в порядке обхода: покомпонентно,
+// каталог идёт раньше своего содержимого
+int walk_order_cmp(const char *a, const char *b) {
+    while (*a && *b) {
+        size_t la = strcspn(a, "/"), lb = strcspn(b, "/");
+        int c = memcmp(a, b, MIN(la, lb));
+        if (c != 0)
+            return c;
+        if (la != lb)
+            return la < lb ? -1 : 1;
+        a += la;
+        b += lb;
+        if (*a == '/') a++;
+        if (*b == '/') b++;
+    }
+    return (*a != '\0') - (*b != '\0');
+}
+
+// Запись каталога при обходе: из readdir() или из снимка
+typedef struct {
+    const char *name;
+    char *own;                  // Копия имени из readdir() (NULL - имя в снимке)
+    uint32_t type;              // SNAP_* | SNAP_LINK
+    int known;                  // Тип, размер и mtime известны
+    uint64_t size;
+    int64_t mtime_sec, mtime_nsec;
+} walk_ent;
+
+// Сравнение имён для сортировки содержимого каталога
+static int walk_ent_cmp(const void *a, const void *b) {
+    return strcmp(((const walk_ent *)a)->name, ((const walk_ent *)b)->name);
+}
+
+static int snap_dir_cmp(const void *key, const void *dir) {
+    return strcmp(key, snap_old_names + ((const struct snap_dir *)dir)->path);
+}
+
+// Поиск неизменного каталога в прошлом снимке. Каталог, изменённый не раньше
+// чем за секунду до прошлого обхода, не считается неизменным: при грубых
+// отметках времени изменение сразу после чтения могло не сдвинуть mtime.
+static const struct snap_dir *snap_find(const char *rel, const struct stat *dsb) {
+    if (!snap_old)
+        return NULL;
+    const struct snap_dir *d = bsearch(rel, snap_old_dirs, snap_old->dirs_len, sizeof(*d), snap_dir_cmp);
+    if (!d || d->dev != (uint64_t)dsb->st_dev || d->ino != (uint64_t)dsb->st_ino
+            || d->mtime_sec != dsb->st_mtim.tv_sec || d->mtime_nsec != dsb->st_mtim.tv_nsec
+            || d->ctime_sec != dsb->st_ctim.tv_sec || d->ctime_nsec != dsb->st_ctim.tv_nsec
+            || d->mtime_sec >= snap_old->scan_time - 1)
+        return NULL;
+    return d;
+}
+
+// Добавление строки в строки нового снимка
+static uint64_t snap_add_name(const char *name) {
+    size_t len = strlen(name) + 1;
+    if (snap_names_len + len > snap_names_cap) {
+        snap_names_cap = MAX(snap_names_len + len, MAX(snap_names_cap * 2, 4096));
+        snap_names = realloc(snap_names, snap_names_cap);
+    }
+    memcpy(snap_names + snap_names_len, name, len);
+    snap_names_len += len;
+    return snap_names_len - len;
+}
+
+// Добавление полностью прочитанного каталога в новый снимок
+static void snap_record(const char *rel, const struct stat *dsb, const walk_ent *ents, size_t ents_len) {
+    if (snap_dirs_len == snap_dirs_cap) {
+        snap_dirs_cap = snap_dirs_cap ? snap_dirs_cap * 2 : 256;
+        snap_dirs = realloc(snap_dirs, snap_dirs_cap * sizeof(*snap_dirs));
+    }
+    if (snap_ents_len + ents_len > snap_ents_cap) {
+        snap_ents_cap = MAX(snap_ents_len + ents_len, MAX(snap_ents_cap * 2, 1024));
+        snap_ents = realloc(snap_ents, snap_ents_cap * sizeof(*snap_ents));
+    }
+
+    snap_dirs[snap_dirs_len++] = (struct snap_dir){
+        .dev = dsb->st_dev, .ino = dsb->st_ino,
+        .mtime_sec = dsb->st_mtim.tv_sec, .mtime_nsec = dsb->st_mtim.tv_nsec,
+        .ctime_sec = dsb->st_ctim.tv_sec, .ctime_nsec = dsb->st_ctim.tv_nsec,
+        .path = snap_add_name(rel), .first = snap_ents_len, .count = ents_len,
+    };
+    for (size_t i = 0; i < ents_len; i++) {
+        snap_ents[snap_ents_len++] = (struct snap_ent){
+            .name = snap_add_name(ents[i].name), .size = ents[i].size,
+            .mtime_sec = ents[i].mtime_sec, .mtime_nsec = ents[i].mtime_nsec,
+            .type = ents[i].type,
+        };
+    }
+}
+
+// Каталоги на пути от корня до текущего. Обход следует за символическими
+// ссылками, поэтому ссылка на предка дала бы бесконечную рекурсию.
+typedef struct walk_anc {
+    dev_t dev;
+    ino_t ino;
+    const struct walk_anc *up;
+} walk_anc;
+
+const walk_anc *walk_top = NULL;
+
+// Рекурсивный обход каталога с сортировкой имён.
+// path - буфер размера PATH_MAX, path_len - длина пути в нём, dsb - атрибуты каталога.
+void walk_tree(char *path, size_t path_len, const struct stat *dsb) {
+    walk_ent *ents = NULL;
+    size_t ents_len = 0;
+
+    for (const walk_anc *a = walk_top; a; a = a->up) {
+        if (a->dev == dsb->st_dev && a->ino == dsb->st_ino) {
+            fprintf(stderr, "Directory loop at %s, skipped\n", path);
+            return;
+        }
+    }
+    walk_anc anc = { dsb->st_dev, dsb->st_ino, walk_top };
+
+    // Содержимое неизменного каталога берётся из снимка
+    const struct snap_dir *old = snap_find(rel_path(path), dsb);
+    if (old) {
+        ents = malloc(MAX(old->count, 1) * sizeof(walk_ent));
+        for (uint64_t k = 0; k < old->count; k++) {
+            const struct snap_ent *e = &snap_old_ents[old->first + k];
+            ents[ents_len++] = (walk_ent){
+                .name = snap_old_names + e->name, .type = e->type, .known = !(e->type & SNAP_LINK),
+                .size = e->size, .mtime_sec = e->mtime_sec, .mtime_nsec = e->mtime_nsec,
+            };
+        }
+        snap_replayed++;
+    } else {
+        throttle_io(0, 1);
+        DIR *dir = opendir(path);
+        if (!dir) {
+            fprintf(stderr, "opendir() failed for %s: %s\n", path, strerror(errno));
+            return;
+        }
+
+        // Чтение и сортировка имён
+        size_t ents_cap = 0;
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL) {
+            if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+                continue;
+            if (ents_len == ents_cap) {
+                ents_cap = ents_cap ? ents_cap * 2 : 64;
+                ents = realloc(ents, ents_cap * sizeof(walk_ent));
+            }
+            // Тип (и то, ссылка ли это) определяется lstat() при проверке записи:
+            // d_type на NFS и других ФС бывает DT_UNKNOWN
+            char *name = strdup(entry->d_name);
+            ents[ents_len++] = (walk_ent){ .name = name, .own = name };
+        }
+        closedir(dir);
+        qsort(ents, ents_len, sizeof(walk_ent), walk_ent_cmp);
+        snap_read++;
+    }
+
+    int complete = 1;           // Все записи каталога проверены (можно сохранить в снимок)
+    for (size_t i = 0; i < ents_len; i++) {
+        walk_ent *e = &ents[i];
+        size_t name_len = strlen(e->name);
+        if (path_len + 1 + name_len >= PATH_MAX) {
+            fprintf(stderr, "Path too long: %s/%s\n", path, e->name);
+            complete = 0;
+            continue;
+        }
+        path[path_len] = '/';
+        memcpy(path + path_len + 1, e->name, name_len + 1);
+        size_t child_len = path_len + 1 + name_len;
+
+        // Пропуск уже пройденной части дерева при возобновлении (до stat())
+        if (resume_frontier) {
+            const char *rel = rel_path(path);
+            size_t rl = strlen(rel);
+            int on_frontier = !strncmp(resume_frontier, rel, rl) && resume_frontier[rl] == '/';
+            if (!on_frontier) {
+                if (walk_order_cmp(rel, resume_frontier) <= 0) {
+                    complete = 0;
+                    continue;   // Файл или поддерево завершены целиком
+                }
+                // Фронт пройден, дальше ничего не пропускается
+                free(resume_frontier);
+                resume_frontier = NULL;
+            }
+        }
+
+        // Подкаталоги проверяются всегда: их изменение не меняет mtime родителя.
+        // Ссылка запоминается как ссылка, чтобы её цель проверялась при каждом обходе.
+        struct stat sb;
+        if (!e->known || (e->type & ~SNAP_LINK) == SNAP_DIR) {
+            int is_link = 0;
+            int rc = fstatat(AT_FDCWD, path, &sb, AT_SYMLINK_NOFOLLOW);
+            if (rc == 0 && S_ISLNK(sb.st_mode)) {
+                is_link = 1;
+                rc = stat(path, &sb);
+            }
+            if (rc == -1) {
+                fprintf(stderr, "stat() failed for %s: %s\n", path, strerror(errno));
+                complete = 0;
+                continue;
+            }
+            e->type = (is_link ? SNAP_LINK : 0) | (S_ISDIR(sb.st_mode) ? SNAP_DIR : S_ISREG(sb.st_mode) ? SNAP_REG : SNAP_OTHER);
+            e->size = sb.st_size;
+            e->mtime_sec = sb.st_mtim.tv_sec;
+            e->mtime_nsec = sb.st_mtim.tv_nsec;
+            e->known = 1;
+        } else {
+            memset(&sb, 0, sizeof(sb));
+            sb.st_mode = (e->type & ~SNAP_LINK) == SNAP_REG ? S_IFREG : 0;
+            sb.st_size = e->size;
+            sb.st_mtim.tv_sec = e->mtime_sec;
+            sb.st_mtim.tv_nsec = e->mtime_nsec;
+        }
+
+        if (S_ISDIR(sb.st_mode)) {
+            walk_top = &anc;
+            walk_tree(path, child_len, &sb);
+            walk_top = anc.up;
+        } else if (S_ISREG(sb.st_mode)) {
+            walk_func(path, &sb, FTW_F);
+
+            // Файл завершён - он становится фронтом обхода
+            // (в окне упорядочивания фронт сдвигает order_drain())
+            if (ckpt_file && !order_win)
+                ckpt_advance(strdup(rel_path(path)));
+        }
+    }
+    path[path_len] = '\0';
+
+    if (snap_name && complete)
+        snap_record(rel_path(path), dsb, ents, ents_len);
+    for (size_t i = 0; i < ents_len; i++)
+        free(ents[i].own);
+    free(ents);
+}
+
+// Загрузка прошлого снимка. Отсутствующий или повреждённый снимок не ошибка:
+// дерево читается целиком, и снимок записывается заново.
+int snap_load(const char *fname) {
+    snap_scan_time = time(NULL);
+    int fd = open(fname, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        if (errno != ENOENT)
+            fprintf(stderr, "Cannot open snapshot %s: %s\n", fname, strerror(errno));
+        return 0;
+    }
+    struct stat sb;
+    if (fstat(fd, &sb) == -1 || (size_t)sb.st_size < sizeof(struct snap_header)) {
+        close(fd);
+        fprintf(stderr, "Snapshot %s is damaged, ignored\n", fname);
+        return 0;
+    }
+    snap_map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (snap_map == MAP_FAILED) {
+        snap_map = NULL;
+        fprintf(stderr, "mmap() failed for %s: %s\n", fname, strerror(errno));
+        return 0;
+    }
+    snap_map_len = sb.st_size;
+
+    // Проверка размеров частей и того, что строки и записи не выходят за границы
+    const struct snap_header *h = snap_map;
+    size_t dirs_size = h->dirs_len * sizeof(struct snap_dir), ents_size = h->ents_len * sizeof(struct snap_ent);
+    int ok = !memcmp(h->magic, SNAP_MAGIC, 8) && h->names_len > 0
+        && h->dirs_len < snap_map_len && h->ents_len < snap_map_len
+        && sizeof(*h) + dirs_size + ents_size + h->names_len == snap_map_len;
+    const struct snap_dir *dirs = (const void *)(h + 1);
+    const struct snap_ent *ents = (const void *)((const char *)dirs + dirs_size);
+    const char *names = (const char *)ents + ents_size;
+    ok = ok && names[h->names_len - 1] == '\0';
+    for (uint64_t d = 0; ok && d < h->dirs_len; d++)
+        ok = dirs[d].path < h->names_len && dirs[d].first <= h->ents_len && dirs[d].count <= h->ents_len - dirs[d].first;
+    for (uint64_t e = 0; ok && e < h->ents_len; e++)
+        ok = ents[e].name < h->names_len;
+    if (!ok) {
+        fprintf(stderr, "Snapshot %s is damaged, ignored\n", fname);
+        snap_free();
+        return 0;
+    }
+
+    snap_old = h;
+    snap_old_dirs = dirs;
+    snap_old_ents = ents;
+    snap_old_names = names;
+    return 0;
+}
+
+static int snap_sort_cmp(const void *a, const void *b) {
+    return strcmp(snap_names + ((const struct snap_dir *)a)->path, snap_names + ((const struct snap_dir *)b)->path);
+}
+
+// Запись нового снимка во временный файл и замена им прошлого
+int snap_save(void) {
+    qsort(snap_dirs, snap_dirs_len, sizeof(*snap_dirs), snap_sort_cmp);
+    if (snap_names_len == 0)
+        snap_add_name("");
+
+    struct snap_header h = { .scan_time = snap_scan_time, .dirs_len = snap_dirs_len,
+                             .ents_len = snap_ents_len, .names_len = snap_names_len };
+    memcpy(h.magic, SNAP_MAGIC, 8);
+
+    size_t tmp_len = strlen(snap_name) + 5;
+    char tmp[tmp_len];
+    snprintf(tmp, tmp_len, "%s.tmp", snap_name);
+    FILE *f = fopen(tmp, "w");
+    if (!f) {
+        fprintf(stderr, "Cannot write snapshot %s: %s\n", tmp, strerror(errno));
+        return -1;
+    }
+    fwrite(&h, sizeof(h), 1, f);
+    fwrite(snap_dirs, sizeof(*snap_dirs), snap_dirs_len, f);
+    fwrite(snap_ents, sizeof(*snap_ents), snap_ents_len, f);
+    fwrite(snap_names, 1, snap_names_len, f);
+    // Данные должны оказаться на диске раньше, чем rename() заменит прошлый снимок
+    int failed = fflush(f) != 0 || ferror(f) || fsync(fileno(f)) == -1;
+    if (fclose(f) != 0 || failed || rename(tmp, snap_name) == -1) {
+        fprintf(stderr, "Cannot write snapshot %s: %s\n", snap_name, strerror(errno));
+        unlink(tmp);
+        return -1;
+    }
+
+    if (getenv("LAB1DEBUG") != NULL)
+        fprintf(stderr, "Snapshot: %lu directories replayed, %lu read\n", snap_replayed, snap_read);
+    return 0;
+}
+
+// Освобождение прошлого и нового снимков
+void snap_free(void) {
+    if (snap_map)
+        munmap(snap_map, snap_map_len);
+    snap_map = NULL;
+    snap_old = NULL;
+    free(snap_dirs);
+    free(snap_ents);
+    free(snap_names);
+    snap_dirs = NULL;
+    snap_ents = NULL;
+    snap_names = NULL;
+    snap_dirs_len = snap_dirs_cap = snap_ents_len = snap_ents_cap = snap_names_len = snap_names_cap = 0;
+}
+
+// Функция для обхода каталогов
+void walk_dir(const char *dir) {
+    char path[PATH_MAX];
+    size_t len = strlen(dir);
+    if (len >= PATH_MAX) {
+        fprintf(stderr, "Path too long: %s\n", dir);
+        return;
+    }
+    memcpy(path, dir, len + 1);
+    while (len > 1 && path[len - 1] == '/')
+        path[--len] = '\0';
+    root_len = len;
+
+    struct stat sb;
+    if (stat(path, &sb) == -1) {
+        fprintf(stderr, "stat() failed for %s: %s\n", path, strerror(errno));
+        return;
+    }
+    if (S_ISDIR(sb.st_mode))
+        walk_tree(path, len, &sb);
+    else
+        walk_func(path, &sb, FTW_F);
+    iso_drain();
+    pool_drain();
+    order_drain();
+    ckpt_flush();
+    sink_flush_all();
+}
+
+// Загрузка контрольной точки: последний записанный фронт.
+// Незавершённая (оборванная) последняя строка игнорируется.
+int ckpt_load(const char *fname) {
+    FILE *f = fopen(fname, "r");
+    if (!f) {
+        fprintf(stderr, "Cannot open checkpoint %s: %s\n", fname, strerror(errno));
+        return -1;
+    }
+
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    while ((len = getline(&line, &cap, f)) > 0) {
+        if (line[len - 1] != '\n' || len < 3 || line[1] != ' ')
+            continue;
+        line[len - 1] = '\0';
+        if (line[0] == 'F') {
+            free(resume_frontier);
+            resume_frontier = strdup(line + 2);
+        }
+    }
+    free(line);
+    fclose(f);
+
+    if (getenv("LAB1DEBUG") != NULL)
+        fprintf(stderr, "Resuming after %s\n", resume_frontier ? resume_frontier : "<start>");
+    return 0;
+}
+
+// Открытие файла контрольной точки на дозапись
+int ckpt_open(const char *fname) {
+    ckpt_file = fopen(fname, "a");
+    if (!ckpt_file) {
+        fprintf(stderr, "Cannot open checkpoint %s: %s\n", fname, strerror(errno));
+        return -1;
+    }
+    ckpt_last = time(NULL);
+    return 0;
+}
+
+// Запись накопленного пакета: строки результатов и новый фронт одной дозаписью,
+// затем сброс буфера результатов (до этого они в stdout не попадают). При падении между ними результаты сохраняются в файле точки.
+// С контрольной точкой результаты потоков и процессов идут через окно
+// упорядочивания в буфер потока обхода, поэтому конвейер не останавливается.
+void ckpt_flush(void) {
+    if (!ckpt_file || !ckpt_frontier || (ckpt_pending == 0 && ckpt_buf_len == 0))
+        return;
+
+    fwrite(ckpt_buf, 1, ckpt_buf_len, ckpt_file);
+    fprintf(ckpt_file, "F %s\n", ckpt_frontier);
+    fflush(ckpt_file);
+    if (sink_main.len > 0)
+        sink_write(&sink_main);
+
+    ckpt_buf_len = 0;
+    ckpt_pending = 0;
+    ckpt_last = time(NULL);
+}
+
+// Закрытие файла контрольной точки
+void ckpt_close(void) {
+    if (ckpt_file) {
+        ckpt_flush();
+        fclose(ckpt_file);
     }
+    ckpt_file = NULL;
+    free(ckpt_buf);
+    free(ckpt_frontier);
+    free(resume_frontier);
+    ckpt_buf = ckpt_frontier = resume_frontier = NULL;
 }
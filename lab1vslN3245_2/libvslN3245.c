@@ -4,6 +4,9 @@
 #define _XOPEN_SOURCE 500
 #include <stdio.h>
 #include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include "plugin_api.h"
 
@@ -15,13 +18,41 @@ static char *g_author = "Lozhkin Vladislav";
 static struct plugin_option g_options[] = {
     {
         {"bit-seq", required_argument, 0, 0},
-        "Битовая последовательность для поиска"
+        "Битовая последовательность для поиска: 0b..., число или 0x...; с --align число - целые байты, 0x... - 4 бита на цифру"
     }
 };
 
 // Количество поддерживаемых опций плагина
 static int g_options_len = sizeof(g_options) / sizeof(g_options[0]);
 
+// Версия ABI, согласованная с хостом (без согласования - версия 1)
+static int g_api_version = 1;
+
+// Битовая последовательность для поиска
+struct bit_pattern {
+    unsigned long long value;   // Последовательность, выровненная по младшим битам
+    unsigned long long mask;    // Маска из num_bits младших единиц
+    size_t num_bits;            // Длина последовательности в битах
+    size_t aligned_bits;        // Длина при поиске с выравниванием (--align)
+};
+
+// Состояние потокового поиска: последние 64 бита файла в скользящем окне
+struct bit_stream {
+    unsigned long long window;  // Последние прочитанные биты, младший - самый новый
+    unsigned long long bits;    // Сколько бит прочитано всего
+    unsigned long long base;    // Смещение первого бита потока в файле, в битах
+    unsigned long long stride;  // Шаг допустимых начал совпадения в битах (0 - любой бит)
+    int found;                  // Последовательность уже найдена
+    size_t pat_len;             // Количество шаблонов (каждая опция bit-seq - шаблон)
+    struct bit_pattern pats[];
+};
+
+// Функция согласования версии ABI с хостом
+int plugin_negotiate(int host_version) {
+    g_api_version = host_version < PLUGIN_API_VERSION ? host_version : PLUGIN_API_VERSION;
+    return g_api_version;
+}
+
 // Функция для получения информации о плагине
 int plugin_get_info(struct plugin_info *ppi)
 {
@@ -38,41 +69,18 @@ int plugin_get_info(struct plugin_info *ppi)
     ppi->sup_opts_len = g_options_len;
     ppi->sup_opts = g_options;
 
-    return 0;
-}
-
-// Функция для обработки файла с учетом опций
-int plugin_process_file(const char *filename, struct option *opts, size_t opts_len) {
-    // Проверка допустимости входных параметров
-    if (!filename || !opts || opts_len == 0) {
-        errno = EINVAL;
-        return -1;
-    }
-    
-    // Открытие файла для чтения в бинарном режиме
-    FILE *file = fopen(filename, "rb");
-    if (!file) {
-        perror("Error opening file");
-        return -1;
+    // Возможности плагина сообщаются только хосту версии 2
+    if (g_api_version >= 2) {
+        ppi->api_version = g_api_version;
+        ppi->caps = PLUGIN_CAP_REENTRANT | PLUGIN_CAP_BUFFER | PLUGIN_CAP_STREAM | PLUGIN_CAP_MULTI | PLUGIN_CAP_REGION;
+        ppi->cost_per_byte = 20.0;
     }
 
-    // Поиск значения опции среди переданных
-    const char *bitseq_value_str = NULL;
-    for (size_t i = 0; i < opts_len; i++) {
-        if (strcmp(opts[i].name, "bit-seq") == 0) {
-            bitseq_value_str = (const char*)opts[i].flag;
-            break;
-        }
-    }
-
-    // Проверка наличия значения опции
-    if (!bitseq_value_str) {
-        fprintf(stderr, "ERROR: Option value is missing\n");
-        fclose(file);
-        return -1;
-    }
+    return 0;
+}
 
-    // Преобразование строки в число с поддержкой двоичного, десятичного и шестнадцатеричного форматов
+// Преобразование строки в шаблон с поддержкой двоичного, десятичного и шестнадцатеричного форматов
+static int parse_pattern(const char *bitseq_value_str, struct bit_pattern *pat) {
     unsigned long long bit_seq = 0;
     size_t num_bits = 0;
     if (strncmp(bitseq_value_str, "0b", 2) == 0) {
@@ -83,17 +91,23 @@ int plugin_process_file(const char *filename, struct option *opts, size_t opts_l
                 num_bits++;
             } else {
                 fprintf(stderr, "ERROR: Invalid binary digit '%c'\n", bitseq_value_str[i]);
-                fclose(file);
+                errno = EINVAL;
                 return -1;
             }
         }
+        if (num_bits > 64) {
+            fprintf(stderr, "ERROR: Bit sequence '%s' is longer than 64 bits\n", bitseq_value_str);
+            errno = ERANGE;
+            return -1;
+        }
     } else {
         // Десятичный и шестнадцатеричный форматы
         char *endptr;
+        errno = 0;
         bit_seq = strtoull(bitseq_value_str, &endptr, 0);
-        if (*endptr != '\0' || errno == ERANGE || errno != 0) {
+        if (*endptr != '\0' || endptr == bitseq_value_str || errno != 0) {
             fprintf(stderr, "ERROR: Invalid numeric argument '%s'\n", bitseq_value_str);
-            fclose(file);
+            errno = EINVAL;
             return -1;
         }
 
@@ -105,42 +119,208 @@ int plugin_process_file(const char *filename, struct option *opts, size_t opts_l
         }
     }
 
-    // Буфер для чтения файла
-    unsigned char buffer[1024];
-    size_t bytesRead, totalBytes = 0;
+    pat->value = bit_seq;
+    pat->num_bits = num_bits;
+    pat->mask = num_bits == 64 ? ~0ULL : (1ULL << num_bits) - 1;
 
-    // Чтение файла и поиск последовательности
-    while ((bytesRead = fread(buffer + totalBytes, 1, sizeof(buffer) - totalBytes, file)) > 0 || totalBytes >= (num_bits + 7) / 8) {
-        totalBytes += bytesRead;
+    // С выравниванием совпадение начинается с начала байта, поэтому ведущие
+    // нули значимы: шестнадцатеричная цифра - ровно 4 бита (0x0045 - два байта),
+    // число дополняется нулями до целых байт (69 и 0x45 - байт 01000101)
+    if (strncasecmp(bitseq_value_str, "0x", 2) == 0)
+        pat->aligned_bits = 4 * strlen(bitseq_value_str + 2);
+    else if (strncmp(bitseq_value_str, "0b", 2) == 0)
+        pat->aligned_bits = num_bits;
+    else
+        pat->aligned_bits = (num_bits + 7) & ~(size_t)7;
+    return 0;
+}
 
-        // Поиск битовой последовательности в буфере
-        for (size_t i = 0; i <= totalBytes * 8 - num_bits; ++i) {
-            unsigned long long value = 0;
-            for (size_t j = 0; j < num_bits; ++j) {
-                value <<= 1;
-                value |= (buffer[(i + j) / 8] >> (7 - (i + j) % 8)) & 1;
+// Создание состояния поиска по всем переданным опциям bit-seq
+void *plugin_stream_open(struct option *opts, size_t opts_len) {
+    // Проверка допустимости входных параметров
+    if (!opts || opts_len == 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    struct bit_stream *st = calloc(1, sizeof(struct bit_stream) + opts_len * sizeof(struct bit_pattern));
+    if (!st)
+        return NULL;
+
+    // Поиск значений опции среди переданных
+    for (size_t i = 0; i < opts_len; i++) {
+        if (strcmp(opts[i].name, "bit-seq") != 0)
+            continue;
+        const char *bitseq_value_str = (const char*)opts[i].flag;
+        if (!bitseq_value_str || parse_pattern(bitseq_value_str, &st->pats[st->pat_len]) == -1) {
+            if (!bitseq_value_str) {
+                fprintf(stderr, "ERROR: Option value is missing\n");
+                errno = EINVAL;
             }
-            if (value == bit_seq) {
+            free(st);
+            return NULL;
+        }
+        // Пустая последовательность содержится в любом файле
+        if (st->pats[st->pat_len].num_bits == 0)
+            st->found = 1;
+        st->pat_len++;
+    }
+
+    // Проверка наличия значения опции
+    if (st->pat_len == 0) {
+        fprintf(stderr, "ERROR: Option value is missing\n");
+        free(st);
+        errno = EINVAL;
+        return NULL;
+    }
+    return st;
+}
+
+// Поиск по участку файла с началом в offset; совпадения проверяются
+// только со смещений, кратных align байтам
+void *plugin_stream_open_region(struct option *opts, size_t opts_len,
+                                unsigned long long offset, size_t align) {
+    struct bit_stream *st = plugin_stream_open(opts, opts_len);
+    if (st) {
+        st->base = offset * 8;
+        st->stride = align * 8;
+    }
+    for (size_t p = 0; st && align > 0 && p < st->pat_len; p++) {
+        struct bit_pattern *pat = &st->pats[p];
+        if (pat->aligned_bits > 64) {
+            fprintf(stderr, "ERROR: Bit sequence is longer than 64 bits\n");
+            free(st);
+            errno = ERANGE;
+            return NULL;
+        }
+        pat->num_bits = pat->aligned_bits;
+        pat->mask = pat->num_bits == 64 ? ~0ULL : (1ULL << pat->num_bits) - 1;
+    }
+    return st;
+}
+
+// Поиск с выравниванием: начала совпадений кратны байту, поэтому окно
+// сдвигается сразу на байт, а каждый шаблон проверяется не больше одного раза
+// на байт - в единственной позиции, где может закончиться выровненное совпадение
+static void feed_aligned(struct bit_stream *st, const unsigned char *buf, size_t len) {
+    for (size_t i = 0; i < len && !st->found; i++) {
+        st->window = (st->window << 8) | buf[i];
+        st->bits += 8;
+        for (size_t p = 0; p < st->pat_len; p++) {
+            const struct bit_pattern *pat = &st->pats[p];
+            // Совпадение с начала байта занимает span бит окна, последние shift из них - лишние
+            size_t span = (pat->num_bits + 7) & ~(size_t)7;
+            size_t shift = span - pat->num_bits;
+            if (st->bits < span || (st->base + st->bits - span) % st->stride != 0)
+                continue;
+            if (((st->window >> shift) & pat->mask) == pat->value) {
                 if (getenv("LAB1DEBUG") != NULL) {
-                    fprintf(stderr, "DEBUG: Found the bit sequence at byte position %zu\n", i / 8);
+                    fprintf(stderr, "DEBUG: Found the bit sequence at byte position %llu\n",
+                            (st->base + st->bits - span) / 8);
                 }
-                fclose(file);
-                return 0;
+                st->found = 1;
+                break;
             }
         }
+    }
+}
 
-        // Перемещение оставшихся байтов в начало буфера
-        if (totalBytes > (num_bits + 7) / 8) {
-            memmove(buffer, buffer + totalBytes - (num_bits + 7) / 8, (num_bits + 7) / 8);
-            totalBytes = (num_bits + 7) / 8;
+// Поиск последовательностей в очередном блоке файла
+int plugin_stream_feed(void *stream, const unsigned char *buf, size_t len) {
+    struct bit_stream *st = stream;
+    if (!st || (!buf && len > 0)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (st->stride > 0) {
+        feed_aligned(st, buf, len);
+        return st->found ? 0 : 1;
+    }
+
+    for (size_t i = 0; i < len && !st->found; i++) {
+        for (int b = 7; b >= 0; b--) {
+            st->window = (st->window << 1) | ((buf[i] >> b) & 1);
+            st->bits++;
+            for (size_t p = 0; p < st->pat_len; p++) {
+                const struct bit_pattern *pat = &st->pats[p];
+                if (st->bits >= pat->num_bits && (st->window & pat->mask) == pat->value) {
+                    if (getenv("LAB1DEBUG") != NULL) {
+                        fprintf(stderr, "DEBUG: Found the bit sequence at byte position %llu\n",
+                                (st->base + st->bits - pat->num_bits) / 8);
+                    }
+                    st->found = 1;
+                    break;
+                }
+            }
+            if (st->found)
+                break;
         }
     }
+    return st->found ? 0 : 1;
+}
+
+// Завершение поиска: 0 - последовательность найдена, 1 - нет
+int plugin_stream_close(void *stream) {
+    struct bit_stream *st = stream;
+    if (!st) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    int found = st->found;
+    free(st);
 
     // Если последовательность не найдена
-    if (getenv("LAB1DEBUG") != NULL) {
+    if (!found && getenv("LAB1DEBUG") != NULL) {
         fprintf(stderr, "DEBUG: Bit sequence not found\n");
     }
+    return found ? 0 : 1;
+}
+
+// Функция для обработки содержимого файла, прочитанного хостом
+int plugin_process_buffer(const unsigned char *buf, size_t len, struct option *opts, size_t opts_len) {
+    void *st = plugin_stream_open(opts, opts_len);
+    if (!st)
+        return -1;
+    plugin_stream_feed(st, buf, len);
+    return plugin_stream_close(st);
+}
+
+// Функция для обработки файла с учетом опций
+int plugin_process_file(const char *filename, struct option *opts, size_t opts_len) {
+    // Проверка допустимости входных параметров
+    if (!filename || !opts || opts_len == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    void *st = plugin_stream_open(opts, opts_len);
+    if (!st)
+        return -1;
+    
+    // Открытие файла для чтения; stdio не нужен - чтение крупными блоками
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        perror("Error opening file");
+        plugin_stream_close(st);
+        return -1;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    // Чтение файла блоками до первого совпадения
+    unsigned char buffer[64 * 1024];
+    ssize_t bytesRead;
+    while ((bytesRead = read(fd, buffer, sizeof(buffer))) != 0) {
+        if (bytesRead == -1 && errno == EINTR)
+            continue;
+        if (bytesRead == -1)
+            break;
+        if (plugin_stream_feed(st, buffer, bytesRead) != 1)
+            break;
+    }
 
-    fclose(file);
-    return 1;
+    close(fd);
+    int res = plugin_stream_close(st);
+    return bytesRead == -1 ? -1 : res;
 }
@@ -2,8 +2,16 @@
 #define _PLUGIN_API_H
 
 #include <getopt.h>
+#include <stddef.h>
 
-#define PLUGIN_API_VERSION  1
+#define PLUGIN_API_VERSION  2
+
+// Возможности плагина (поле caps, начиная с версии 2)
+#define PLUGIN_CAP_REENTRANT    0x01    // Функции обработки можно вызывать из нескольких потоков одновременно
+#define PLUGIN_CAP_BUFFER       0x02    // Есть plugin_process_buffer()
+#define PLUGIN_CAP_STREAM       0x04    // Есть plugin_stream_open()/feed()/close()
+#define PLUGIN_CAP_MULTI        0x08    // Повторённая опция задаёт ещё один шаблон, совпадение любого - успех
+#define PLUGIN_CAP_REGION       0x10    // Есть plugin_stream_open_region() (нужен и PLUGIN_CAP_STREAM)
 
 struct plugin_option {
     struct option opt;
@@ -15,10 +23,38 @@ struct plugin_info {
     const char *plugin_author;
     size_t sup_opts_len;
     struct plugin_option *sup_opts;
+
+    // Поля версии 2. Плагин заполняет их, только если версия 2 согласована
+    // через plugin_negotiate(), поэтому хосты версии 1 их не видят.
+    int api_version;
+    unsigned int caps;
+    double cost_per_byte;       // Примерная стоимость обработки байта, нс (0 - неизвестно)
 };
 
+// Необязательная функция согласования версии: получает версию хоста и возвращает
+// версию, по которой будет работать плагин. Плагин без неё считается плагином версии 1.
+int plugin_negotiate(int host_version);
+
 int plugin_get_info(struct plugin_info* ppi);
 
+// Результат обработки: 0 - файл подходит, 1 - не подходит, -1 - ошибка (errno)
 int plugin_process_file(const char *fname, struct option in_opts[], size_t in_opts_len);
 
+// PLUGIN_CAP_BUFFER: обработка содержимого файла, прочитанного хостом
+int plugin_process_buffer(const unsigned char *buf, size_t len, struct option in_opts[], size_t in_opts_len);
+
+// PLUGIN_CAP_STREAM: обработка файла последовательными блоками.
+// plugin_stream_feed() возвращает 1, пока результат не определён, иначе 0 или -1;
+// plugin_stream_close() возвращает итоговый результат и освобождает состояние.
+void *plugin_stream_open(struct option in_opts[], size_t in_opts_len);
+int plugin_stream_feed(void *stream, const unsigned char *buf, size_t len);
+int plugin_stream_close(void *stream);
+
+// PLUGIN_CAP_REGION: поток по участку файла, который начинается со смещения offset.
+// При align > 0 проверяются только совпадения, начинающиеся со смещений файла,
+// кратных align байтам. Данные передаются plugin_stream_feed(), результат -
+// plugin_stream_close().
+void *plugin_stream_open_region(struct option in_opts[], size_t in_opts_len,
+                                unsigned long long offset, size_t align);
+
 #endif
@@ -0,0 +1,53 @@
+// Тестовый плагин для проверки изолированного режима и --io mmap. Поведение
+// задаётся содержимым файла: "crash" роняет процесс, "hang" вешает его,
+// "truncate <путь>" укорачивает файл <путь> до нуля и читает буфер дальше;
+// остальные файлы подходят.
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include "plugin_api.h"
+
+static struct plugin_option g_options[] = {
+    {
+        {"faulty", required_argument, 0, 0},
+        "Падение, зависание или укорачивание файла по его содержимому"
+    }
+};
+
+int plugin_negotiate(int host_version) {
+    return host_version < PLUGIN_API_VERSION ? host_version : PLUGIN_API_VERSION;
+}
+
+int plugin_get_info(struct plugin_info *ppi) {
+    ppi->plugin_purpose = "Тестовый плагин с ошибками";
+    ppi->plugin_author = "tests";
+    ppi->sup_opts_len = 1;
+    ppi->sup_opts = g_options;
+    ppi->api_version = PLUGIN_API_VERSION;
+    ppi->caps = PLUGIN_CAP_BUFFER;
+    return 0;
+}
+
+int plugin_process_buffer(const unsigned char *buf, size_t len, struct option in_opts[], size_t in_opts_len) {
+    (void)in_opts;
+    (void)in_opts_len;
+    char text[256] = "";
+    memcpy(text, buf, len < sizeof(text) - 1 ? len : sizeof(text) - 1);
+    if (!strcmp(text, "crash"))
+        raise(SIGSEGV);
+    if (!strcmp(text, "hang"))
+        sleep(60);
+    if (!strncmp(text, "truncate ", 9)) {
+        if (truncate(text + 9, 0) == -1)
+            return -1;
+        return buf[len - 1] == 0;
+    }
+    return 0;
+}
+
+int plugin_process_file(const char *fname, struct option in_opts[], size_t in_opts_len) {
+    (void)fname;
+    (void)in_opts;
+    (void)in_opts_len;
+    return 0;
+}
@@ -0,0 +1,248 @@
+#!/bin/sh
+# Дымовые тесты хоста: каждый раздел проверяет одну возможность по точному
+# выводу на маленьком дереве. Запуск из каталога lab1vslN3245_2: make test
+set -u
+
+SRC=$(cd "$(dirname "$0")/.." && pwd)
+BIN="$SRC/lab1vslN3245"
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+# Каталог кеша - свой для каждого прогона; текущий каталог без плагинов,
+# поэтому загружаются только плагины из -P
+export XDG_CACHE_HOME="$WORK/cache"
+unset LAB1NOCACHE LAB1DEBUG
+cd "$WORK" || exit 1
+
+failed=0
+
+# Сравнение результата с ожидаемым: check <название> <ожидается> <получено>
+check() {
+    if [ "$2" = "$3" ]; then
+        echo "ok   $1"
+    else
+        echo "FAIL $1"
+        printf 'expected:\n%s\ngot:\n%s\n' "$2" "$3"
+        failed=1
+    fi
+}
+
+run() {
+    "$BIN" -P "$SRC" "$@" 2>/dev/null
+}
+
+# Дерево: 'E' = 0x45 в a/1, a/2, b/2; b/1 не подходит
+mkdir -p t/a t/b
+printf 'E' > t/a/1
+printf 'E' > t/a/2
+printf 'x' > t/b/1
+printf 'E' > t/b/2
+
+# Кеш манифеста: при первом запуске плагин загружается при поиске (промах),
+# при втором описание берётся из манифеста и плагин загружается перед обходом
+out=$(LAB1DEBUG=1 "$BIN" -P "$SRC" --bit-seq 0x45 t 2>&1 | grep -c '^Loaded plugin')
+check "manifest miss" "0" "$out"
+out=$(LAB1DEBUG=1 "$BIN" -P "$SRC" --bit-seq 0x45 t 2>&1 | grep -c '^Loaded plugin')
+check "manifest hit" "1" "$out"
+out=$(run --bit-seq 0x45 t)
+check "manifest hit output" "Found file: t/a/1
+Found file: t/a/2
+Found file: t/b/2" "$out"
+
+# Контрольная точка: полный обход записывает совпадения и фронт
+out=$(run --bit-seq 0x45 --checkpoint ck t)
+check "checkpoint output" "Found file: t/a/1
+Found file: t/a/2
+Found file: t/b/2" "$out"
+check "checkpoint file" "M a/1
+M a/2
+M b/2
+F b/2" "$(cat ck)"
+
+# С потоками и рабочими процессами фронт сдвигается по окну упорядочивания:
+# точка и вывод те же, что при обработке в одном потоке
+for mode in "--threads 3" "--isolate 2"; do
+    rm -f ckp
+    out=$(run --bit-seq 0x45 $mode --checkpoint ckp t)
+    check "checkpoint $mode output" "Found file: t/a/1
+Found file: t/a/2
+Found file: t/b/2" "$out"
+    check "checkpoint $mode file" "$(cat ck)" "$(cat ckp)"
+done
+
+# Возобновление после a/1: a/1 не проверяется заново
+printf 'M a/1\nF a/1\n' > ck2
+out=$(run --bit-seq 0x45 --resume ck2 t)
+check "resume output" "Found file: t/a/2
+Found file: t/b/2" "$out"
+check "resume checkpoint file" "M a/1
+F a/1
+M a/2
+M b/2
+F b/2" "$(cat ck2)"
+
+# Несколько запросов за один обход
+cat > q <<'Q'
+q1 --bit-seq 0x45
+# комментарий
+q2 -N --bit-seq 0x45
+q3 --expr bit-seq=0x78 OR bit-seq=0x45
+Q
+out=$(run --queries q t)
+check "queries" "[q1] Found file: t/a/1
+[q3] Found file: t/a/1
+[q1] Found file: t/a/2
+[q3] Found file: t/a/2
+[q2] Found file: t/b/1
+[q3] Found file: t/b/1
+[q1] Found file: t/b/2
+[q3] Found file: t/b/2" "$out"
+out=$(run --queries q --threads 3 t)
+check "queries --threads" "$(run --queries q t)" "$out"
+printf 'q1 --bit-seq 0x45\nq1 --bit-seq 0x78\n' > qdup
+run --queries qdup t > /dev/null
+check "queries duplicate id" "1" "$?"
+for flag in -A -O -N; do
+    run "$flag" --queries q t > /dev/null
+    check "queries with $flag" "1" "$?"
+    run "$flag" --expr 'bit-seq=0x45' t > /dev/null
+    check "expr with $flag" "1" "$?"
+done
+
+# Снимок: каталоги со старым mtime воспроизводятся из снимка, изменённый
+# каталог читается заново (на копии дерева, чтобы не менять t)
+cp -r t ts
+touch -d '2020-01-01' ts ts/a ts/b
+out=$(LAB1DEBUG=1 "$BIN" -P "$SRC" --bit-seq 0x45 --snapshot snap ts 2>&1 | grep '^Snapshot:')
+check "snapshot first run" "Snapshot: 0 directories replayed, 3 read" "$out"
+out=$(LAB1DEBUG=1 "$BIN" -P "$SRC" --bit-seq 0x45 --snapshot snap ts 2>&1 | grep '^Snapshot:')
+check "snapshot replay" "Snapshot: 3 directories replayed, 0 read" "$out"
+out=$(run --bit-seq 0x45 --snapshot snap ts)
+check "snapshot replay output" "Found file: ts/a/1
+Found file: ts/a/2
+Found file: ts/b/2" "$out"
+printf 'E' > ts/b/3
+touch -d '2020-01-01' ts/b
+out=$(LAB1DEBUG=1 "$BIN" -P "$SRC" --bit-seq 0x45 --snapshot snap ts 2>&1 | grep -e '^Snapshot:' -e '^Found')
+check "snapshot changed directory" "Found file: ts/a/1
+Found file: ts/a/2
+Found file: ts/b/2
+Found file: ts/b/3
+Snapshot: 2 directories replayed, 1 read" "$out"
+
+# Повтор опции плагина с несколькими шаблонами: с -A нужны все шаблоны,
+# с -O - любой; -N отрицает итог целиком
+mkdir -p m
+printf 'E' > m/1
+printf 'EF' > m/2
+printf 'F' > m/3
+out=$(run -A --bit-seq 0x45 --bit-seq 0x46 m)
+check "repeated option -A" "Found file: m/2" "$out"
+out=$(run -O --bit-seq 0x45 --bit-seq 0x46 m)
+check "repeated option -O" "Found file: m/1
+Found file: m/2
+Found file: m/3" "$out"
+out=$(run -N -A --bit-seq 0x45 --bit-seq 0x46 m)
+check "repeated option -N -A" "Found file: m/1
+Found file: m/3" "$out"
+out=$(run --expr 'bit-seq=0x45 AND bit-seq=0x46' m)
+check "repeated option --expr AND" "Found file: m/2" "$out"
+
+# Форматы вывода; с --threads вывод по умолчанию в порядке обхода
+out=$(run --bit-seq 0x45 --format nul t | tr '\0' '\n')
+check "format nul" "t/a/1
+t/a/2
+t/b/2" "$out"
+out=$(run --bit-seq 0x45 --format jsonl t)
+check "format jsonl" '{"path":"t/a/1"}
+{"path":"t/a/2"}
+{"path":"t/b/2"}' "$out"
+mkdir -p u
+printf 'E' > "u/$(printf 'a\377"b')"
+out=$(run --bit-seq 0x45 --format jsonl u)
+check "format jsonl non-UTF-8 path" '{"path":"u/a\ufffd\"b","path_base64":"dS9h/yJi"}' "$out"
+run --bit-seq 0x45 --format binary t > bin.out
+printf 'LAB1RES\001\001\000\000\000\000\000' > bin.exp
+for f in a/1 a/2 b/2; do
+    printf '\005\000\000\000\000\000\000\000t/%s' "$f" >> bin.exp
+done
+cmp -s bin.exp bin.out
+check "format binary" "0" "$?"
+out=$(run --bit-seq 0x45 --threads 3 t)
+check "threads default order" "$(run --bit-seq 0x45 t)" "$out"
+out=$(run --bit-seq 0x45 --threads 3 --unordered t | sort)
+check "threads --unordered" "$(run --bit-seq 0x45 t)" "$out"
+
+# Изолированный режим: падение и зависание плагина на одном файле не мешают
+# остальным, файл считается необработанным
+mkdir -p plug iso
+${CC:-gcc} -shared -fPIC -I"$SRC" -o plug/libfaulty.so "$SRC/tests/faulty_plugin.c"
+for f in 1 crash 2 hang 3; do printf '%s' "$f" > "iso/$f"; done
+out=$("$BIN" -P plug --faulty 1 --isolate 2 --file-timeout 1 iso 2>&1)
+check "isolate crash and timeout" "Found file: iso/1
+Found file: iso/2
+Found file: iso/3
+Plugin worker crashed on iso/crash (Segmentation fault), file marked as failed
+Plugin worker timed out on iso/hang after 1 s, file marked as failed" "$(printf '%s\n' "$out" | LC_ALL=C sort)"
+
+
+# Способы чтения (--io) дают одинаковый результат, в том числе на файле
+# больше BUF_MAX, который читается блоками
+mkdir -p io
+cp t/a/1 io/e
+cp t/b/1 io/x
+truncate -s 70M io/big
+printf 'E' | dd of=io/big bs=1 seek=70000000 conv=notrunc 2>/dev/null
+expected="Found file: io/big
+Found file: io/e"
+for mode in auto pread mmap direct; do
+    check "io $mode" "$expected" "$(run --bit-seq 0x45 --io $mode io)"
+done
+
+# --io mmap: файл, укороченный во время проверки, считается необработанным
+mkdir -p bus
+printf 'x' > bus/a
+printf 'truncate bus/t' > bus/t
+out=$("$BIN" -P plug --faulty 1 --io mmap bus 2>&1)
+check "io mmap truncated file" "File bus/t was truncated while mapped
+Error in plugin! Input/output errorFound file: bus/a" "$out"
+
+
+# Участки и выравнивание: 0x45 в начале файла (a), со смещения 1 (b), со
+# сдвигом на бит (c) и со смещения 4 (d)
+mkdir -p al
+printf '\105' > al/a
+printf '\000\105' > al/b
+printf '\042\200' > al/c
+printf '\000\000\000\000\105' > al/d
+files() { run "$@" al | sed 's/^Found file: al\///' | tr '\n' ' '; }
+check "align off" "a b c d " "$(files --bit-seq 0x45)"
+check "align 1" "a b d " "$(files --bit-seq 0x45 --align 1)"
+check "align 1 decimal" "a b d " "$(files --bit-seq 69 --align 1)"
+check "align 2" "a d " "$(files --bit-seq 0x45 --align 2)"
+check "align hex leading zeros" "b d " "$(files --bit-seq 0x0045 --align 1)"
+check "range head" "a " "$(files --bit-seq 0x45 --range 0:1)"
+check "range tail" "a b d " "$(files --bit-seq 0x45 --range -1:)"
+check "range and align" "d " "$(files --bit-seq 0x45 --range 2: --align 2)"
+
+
+# Шарды: выводы не пересекаются, вместе дают вывод без --shard
+for i in 0 1 2; do run --bit-seq 0x45 --shard $i/3 t > "shard$i"; done
+check "shard disjoint" "" "$(cat shard0 shard1 shard2 | sort | uniq -d)"
+check "shard union" "$(run --bit-seq 0x45 t | sort)" "$(cat shard0 shard1 shard2 | sort)"
+
+
+# Ограничение нагрузки: результат тот же, чтение 100 КБ при 100 КБ/с
+# занимает заметное время (запас корзины - 0.1 с)
+mkdir -p th
+head -c 100000 /dev/zero > th/z
+printf 'E' > th/e
+start=$(date +%s.%N)
+out=$(run --bit-seq 0x45 --max-read-rate 100K th)
+slow=$(echo "$start $(date +%s.%N)" | awk '{ print ($2 - $1 >= 0.5) }')
+check "max-read-rate" "Found file: th/e" "$out"
+check "max-read-rate delays" "1" "$slow"
+out=$(run --bit-seq 0x45 --max-iops 100 --max-cpu 50 --nice 5 --ioprio idle th)
+check "throttle options" "Found file: th/e" "$out"
+
+exit $failed